@@ -3,34 +3,55 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <poll.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <errno.h>
 #include "interface.h"
+#include "wire.h"
 
 // cpp
 #include <iostream>
+#include <vector>
 using namespace std;
 
 /* Macros */
-#define CREATE 	('\x01')
-#define DELETE 	('\x02')
-#define JOIN	('\x03')
-#define LIST	('\x04')
+#define MAX_MSG			(4096)	// longest chat line we read, no longer capped by MAX_DATA
+#define MAX_INFLIGHT	(64)	// commands sent before we wait on replies
 
 /* Types */
-typedef uint8_t u8;
-typedef uint32_t u32;
+struct pending_cmd {
+	u32 tag;
+	char cmd;					// CREATE, DELETE, JOIN, LIST or STATS
+	char command[MAX_DATA];		// command name, for display_reply
+	bool done;
+	struct Reply reply;
+	string text;				// STATS report, too long for a Reply
+};
 
 /* Forwards */
 int connect_to(const char *host, const int port);
-struct Reply process_command(const int sockfd, char* command);
-void process_chatmode(const char* host, const int port);
+char send_command(const int sockfd, char* command, u32 tag);
+const char* command_name(char cmd);
+struct Reply parse_reply(char cmd, const frame_hdr& hdr, const string& payload);
+void process_chatmode(const int sockfd, const char* host, const int port);
+void read_command(const int sockfd, char* comm, const int size);
 
 /* Globals */
-u8 GLOBAL_UID;	// assigned by the server after a JOIN command
+u8 GLOBAL_UID;		// assigned by the server after a JOIN command
+u32 GLOBAL_ROOM_ID;	// joined room, tags every chat frame
+u32 GLOBAL_NEXT_TAG = 1;	// request id of the next command, 0 is never used
+u32 GLOBAL_LAST_SEQ = 0;	// newest room sequence number seen, MSG or ACK
+
+// Another command line is already waiting, stdin is unbuffered so the fd
+// tells the whole story
+bool stdin_ready() {
+	struct pollfd pfd = { 0, POLLIN, 0 };
+	return poll(&pfd, 1, 0) > 0;
+}
 
 int main(int argc, char** argv) 
 {
@@ -42,29 +63,128 @@ int main(int argc, char** argv)
 	}
 
     display_title();
-    
-	while (1) {
+
+	// One control connection for the whole session, commands typed (or piped)
+	// ahead are sent back to back and their replies matched on TAG
+	int sockfd = connect_to(argv[1], atoi(argv[2]));
+	if (sockfd < 0) {
+		exit(1);
+	}
+	setvbuf(stdin, NULL, _IONBF, 0);
+
+	vector<pending_cmd> inflight;
 	
-		int sockfd = connect_to(argv[1], atoi(argv[2]));
-    
-		char command[MAX_DATA];
-        get_command(command, MAX_DATA);
+	while (1) {
 
-		struct Reply reply = process_command(sockfd, command);
-		display_reply(command, reply);
-		
-		touppercase(command, strlen(command) - 1);
-		if (strncmp(command, "JOIN", 4) == 0 && reply.status == SUCCESS) {
-			printf("Now you are in the chatmode\n");
-			process_chatmode(argv[1], reply.port);
+		// * send commands while more are already queued on stdin, a JOIN
+		//   may switch this connection to chat mode so it goes last
+		inflight.clear();
+		do {
+			pending_cmd p;
+			p.command[0] = '\0';
+			read_command(sockfd, p.command, MAX_DATA);
+			if (feof(stdin))
+				break;
+
+			p.tag = GLOBAL_NEXT_TAG++;
+			p.done = false;
+			if ((p.cmd = send_command(sockfd, p.command, p.tag)) == -1) {
+				exit(1);
+			}
+			strcpy(p.command, command_name(p.cmd));
+			inflight.push_back(p);
+		} while (inflight.back().cmd != JOIN && inflight.size() < MAX_INFLIGHT
+				&& stdin_ready());
+
+		if (inflight.empty()) {
+			break;
 		}
-	
-		close(sockfd);
+
+		// * collect replies, match each to its command by TAG
+		for (size_t n_done = 0; n_done < inflight.size(); ) {
+			frame_hdr hdr;
+			string payload;
+			if (!recv_frame(sockfd, &hdr, &payload)) {
+				printf("Failed on recv\n");
+				exit(1);
+			}
+			if (hdr.type == PING) {
+				send_frame(sockfd, PONG, 0, 0, NULL, 0);
+				continue;
+			}
+			for (size_t i = 0; i < inflight.size(); i++) {
+				pending_cmd& p = inflight[i];
+				if (hdr.type == REPLY && p.tag == hdr.tag && !p.done) {
+					p.reply = parse_reply(p.cmd, hdr, payload);
+					if (p.cmd == STATS && p.reply.status == SUCCESS)
+						p.text = payload.substr(1);
+					p.done = true;
+					++n_done;
+					break;
+				}
+			}
+		}
+
+		// * display in the order commands were typed
+		for (size_t i = 0; i < inflight.size(); i++) {
+			pending_cmd& p = inflight[i];
+			struct Reply& reply = p.reply;
+
+			// Multiplexed rooms (PORT=0) are joined over the server port itself
+			bool is_join = p.cmd == JOIN && reply.status == SUCCESS;
+			int chat_port = reply.port;
+			if (is_join && chat_port == 0) {
+				reply.port = atoi(argv[2]);
+			}
+			display_reply(p.command, reply);
+			if (!p.text.empty())
+				fputs(p.text.c_str(), stdout);
+			
+			if (is_join) {
+				printf("Now you are in the chatmode\n");
+				process_chatmode(sockfd, argv[1], chat_port);
+			}
+		}
+		if (feof(stdin))
+			break;
     }
 
+	close(sockfd);
     return 0;
 }
 
+/*
+ * get_command, except the server's keepalive PINGs are answered while we
+ * wait on the user
+ */
+void read_command(const int sockfd, char* comm, const int size)
+{
+	printf("Command> ");
+	fflush(stdout);
+
+	struct pollfd pfds[2] = { { 0, POLLIN, 0 }, { sockfd, POLLIN, 0 } };
+	while (!stdin_ready()) {
+		if (poll(pfds, 2, -1) < 0 || !(pfds[1].revents)) {
+			continue;
+		}
+		frame_hdr hdr;
+		string payload;
+		if (!recv_frame(sockfd, &hdr, &payload)) {
+			printf("Server disco!\n");
+			exit(1);
+		}
+		if (hdr.type == PING) {
+			send_frame(sockfd, PONG, 0, 0, NULL, 0);
+		}
+	}
+
+	if (fgets(comm, size, stdin) == NULL)
+		return;
+	size_t len = strlen(comm);
+	if (len > 0 && comm[len - 1] == '\n')
+		comm[len - 1] = '\0';
+}
+
 /*
  * Connect to the server using given host and port information
  *
@@ -120,7 +240,7 @@ char set_command_buf(char* buf, char* command) {
 		"COMMAND" or "COMMAND " which would result
 		in segfault by way of strtok
 	*/
-	if (strncmp(command, "LIST", 4) != 0) {
+	if (strncmp(command, "LIST", 4) != 0 && strncmp(command, "STATS", 5) != 0) {
 		int idx = space_idx(command);
 		int c_len = strlen(command);
 		if (idx == -1 || idx == (c_len - 1)) {
@@ -146,13 +266,22 @@ char set_command_buf(char* buf, char* command) {
 		buf[0] = LIST;
 		buf[1] = '\0';
 		return LIST;
+	} else if (strncmp(cmd, "STATS", 5) == 0) {
+		// room name is optional, none means every room
+		cmd_code = STATS;
+		if ((name = strtok(NULL, " ")) == NULL) {
+			buf[0] = STATS;
+			buf[1] = '\0';
+			return STATS;
+		}
 	} else {
 		printf("Unknown command to parse\n");
 		return -1;
 	}
 
 	// Get command params
-	name = strtok(NULL, " ");
+	if (cmd_code != STATS)
+		name = strtok(NULL, " ");
 
 	// Compose buffer
 	buf[0] = cmd_code;
@@ -163,43 +292,68 @@ char set_command_buf(char* buf, char* command) {
 	return cmd_code;
 }
 
+// set_command_buf tokenizes (and may re-prompt for) the line, display_reply
+// only needs the command name back
+const char* command_name(char cmd) {
+	switch (cmd) {
+		case CREATE:	return "CREATE";
+		case DELETE:	return "DELETE";
+		case JOIN:		return "JOIN";
+		case STATS:		return "STATS";
+		default:		return "LIST";
+	}
+}
+
 void bytearray_to_int(int* i, char* ba) {
 	// Verify this call on C9, else bitshift the value (*)(!)
 	memcpy(i, ba, 4);
 }
 
 /* 
- * Send an input command to the server and return the result
+ * Send an input command to the server, the reply is read by the caller
  *
  * @parameter sockfd   socket file descriptor to commnunicate
  *                     with the server
  * @parameter command  command will be sent to the server
+ * @parameter tag      request id, echoed on the reply
  *
- * @return    Reply    
+ * @return    command code, -1 on an unknown command
  */
-struct Reply process_command(const int sockfd, char* command)
+char send_command(const int sockfd, char* command, u32 tag)
 {
 	char cmd_buf[MAX_DATA];
 	char cmd;
 	
 	if ((cmd = set_command_buf(cmd_buf, command)) == -1) {
 		printf("Failed on setting command buf\n");
-		exit(1);
+		return -1;
 	}
 
-	// * Send
-	if (send(sockfd, cmd_buf, strlen(cmd_buf) + 1, 0) < 0) {
+	// * Send {TYPE=CMD||...||TAG||NAME}, name is everything after the command byte
+	if (!send_frame(sockfd, cmd, 0, 0, cmd_buf + 1, strlen(cmd_buf + 1), tag)) {
 		printf("Failed on send\n");
-		return (struct Reply) { FAILURE_UNKNOWN, };
+		exit(1);
 	}
+	return cmd;
+}
 
-	// * Recv
-	int recv_size;
-	char reply_buf[MAX_DATA];
-	if ((recv_size = recv(sockfd, reply_buf, MAX_DATA, 0)) < 0) {
-		printf("Failed on recv\n");
+/* 
+ * Turn a reply frame into the Reply for display
+ *
+ * @parameter cmd      command the reply answers
+ * @parameter hdr      reply frame header
+ * @parameter payload  {1B STATUS||...}
+ *
+ * @return    Reply    
+ */
+struct Reply parse_reply(char cmd, const frame_hdr& hdr, const string& payload)
+{
+	int len;
+
+	if (hdr.len < 1) {
 		return (struct Reply) { FAILURE_UNKNOWN, };
 	}
+	const char* reply_buf = payload.data();
 
 	// Enum key:
 	// SUCCESS					=\x00
@@ -208,7 +362,7 @@ struct Reply process_command(const int sockfd, char* command)
     // FAILURE_INVALID			=\x03
     // FAILURE_UNKNOWN			=\x04
 	
-	// Expect packet = {1B STATUS||<=255B MSG }
+	// Expect payload = {1B STATUS||NB MSG }
 	struct Reply repl;
 	repl.status = (enum Status)reply_buf[0];
 
@@ -222,25 +376,38 @@ struct Reply process_command(const int sockfd, char* command)
 			break;
 
 		case DELETE:
-			printf("%s", reply_buf + 1);
 			break;
 
 		case JOIN:
-			// Expect packet = {1B STATUS||1B UID||4B N_MEMBER||4B PORT}
+			// Expect payload = {1B STATUS||1B UID||4B N_MEMBER||4B PORT}
+			// with the room id in the frame header, PORT=0 means the room
+			// is multiplexed over this connection
 			// 4B integers are serialized network byteorder (Big-Endian)
+			if (hdr.len < 10) {
+				repl.status = FAILURE_UNKNOWN;
+				break;
+			}
 			
 			// Extract & place parameters in ints, network byte order (!) test on C9 (*)
 			GLOBAL_UID = *(reply_buf + 1);
+			GLOBAL_ROOM_ID = hdr.room_id;
 			int n_members_nb, port_nb;
-			bytearray_to_int(&n_members_nb, reply_buf + 2);
-			bytearray_to_int(&port_nb, reply_buf + 6);
+			bytearray_to_int(&n_members_nb, (char*) reply_buf + 2);
+			bytearray_to_int(&port_nb, (char*) reply_buf + 6);
 
 			repl.num_member = (int) ntohl((u32) n_members_nb);
 			repl.port = (int) ntohl((u32) port_nb);
 			break;
 
 		case LIST:
-			strcpy(repl.list_room, reply_buf+1);
+			// Reply can't hold more than MAX_DATA, truncate a long list
+			len = min((int) hdr.len - 1, MAX_DATA - 1);
+			memcpy(repl.list_room, reply_buf + 1, len);
+			repl.list_room[len] = '\0';
+			break;
+
+		case STATS:
+			// Expect payload = {1B STATUS||TEXT}, the caller keeps the text
 			break;
 
 		default:
@@ -250,67 +417,177 @@ struct Reply process_command(const int sockfd, char* command)
 	return repl;
 }
 
-void* server_response_handler(void* _sock) {
-	
-	int sock = *(int*)_sock;
-	char buf[MAX_DATA];
-	int size_recv;
-
-	while ((size_recv = recv(sock, buf, MAX_DATA, 0)) > 0) {
-		buf[size_recv] = '\0';
-		if (buf[0]) {
-			display_message(buf);
+// Write all of buf to fd, the terminal may take it in pieces
+void write_all(int fd, const string& buf)
+{
+	size_t off = 0;
+	while (off < buf.length()) {
+		ssize_t n = write(fd, buf.data() + off, buf.length() - off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		off += n;
+	}
+}
+
+/*
+ * Track the room's sequence numbers, ask for whatever we skipped over
+ *
+ * Live frames only go up, anything at or below the newest seen is an answer
+ * to an earlier RESEND. The first number we see is where we came in
+ */
+void chat_seq(const int sockfd, const u32 seq)
+{
+	if (seq == 0 || seq <= GLOBAL_LAST_SEQ)
+		return;
+	if (GLOBAL_LAST_SEQ && seq > GLOBAL_LAST_SEQ + 1) {
+		// * {4B FIRST||4B LAST}
+		u32 range[2] = { htonl(GLOBAL_LAST_SEQ + 1), htonl(seq - 1) };
+		send_frame(sockfd, RESEND, GLOBAL_UID, GLOBAL_ROOM_ID, (char*) range, sizeof(range));
+	}
+	GLOBAL_LAST_SEQ = seq;
+}
+
+/*
+ * Handle every complete frame in in, chat lines are appended to display
+ *
+ * Frames hold MSG from other members (or resent), ACK for our own or a
+ * NOTICE from the server, payloads aren't nullterminated on the wire
+ *
+ * @return false on a frame we can't make sense of
+ */
+bool chat_frames(const int sockfd, string* in, string* display)
+{
+	frame_hdr hdr;
+	size_t off = 0;
+	int ok;
+
+	while ((ok = peek_frame(in->data() + off, in->size() - off, &hdr)) == 1) {
+		const char* payload = in->data() + off + HDR_LEN;
+		off += HDR_LEN + hdr.len;
+
+		if (hdr.type == PING) {
+			send_frame(sockfd, PONG, GLOBAL_UID, GLOBAL_ROOM_ID, NULL, 0);
+		} else if (hdr.type == ACK) {
+			chat_seq(sockfd, hdr.tag);
+		} else if (hdr.type == MSG || hdr.type == NOTICE) {
+			if (hdr.type == MSG)
+				chat_seq(sockfd, hdr.tag);
+
+			// same as display_message(...), one line per message
+			display->append("> ");
+			display->append(payload, hdr.len);
+			display->append("\n");
 		}
-		cout << '\n';
 	}
-	cout << "Server disco!\n";
+	in->erase(0, off);
+	return ok >= 0;
+}
 
-	return 0;
+/*
+ * Send each complete line in line as its own MSG, lines longer than MAX_MSG
+ * go as several. With flush the unterminated tail goes too (stdin hit EOF)
+ */
+void chat_lines(const int sockfd, string* line, bool flush)
+{
+	size_t start = 0, nl;
+	while (true) {
+		nl = line->find('\n', start);
+		size_t len = (nl == string::npos ? line->size() : nl) - start;
+		if (nl == string::npos && (!flush || len == 0) && len < MAX_MSG - 1)
+			break;
+		len = min(len, (size_t) MAX_MSG - 1);
+
+		// * Frame the message = {MSG||UID||ROOM_ID||TAG||LEN||PAYLOAD}
+		// * Send on sock, only the bytes we actually have
+		if (!send_frame(sockfd, MSG, GLOBAL_UID, GLOBAL_ROOM_ID, line->data() + start, len)) {
+			puts("Failure on send");
+			exit(1);
+		}
+		start += len;
+		if (start < line->size() && (*line)[start] == '\n')
+			++start;
+	}
+	line->erase(0, start);
 }
 
 /* 
  * Get into the chat mode
+ *
+ * One thread polls stdin and the chat socket. Whatever a wakeup brings in
+ * from the room is drained and parsed, then shown with a single write, so a
+ * busy room costs one terminal write per burst rather than per message.
+ * At EOF on stdin we keep following the room until the server hangs up.
  * 
+ * @parameter sockfd   control connection, reused for multiplexed rooms
  * @parameter host     host address
- * @parameter port     port
+ * @parameter port     room port, 0 if the room is multiplexed over sockfd
  */
-void process_chatmode(const char* host, const int port)
+void process_chatmode(const int sockfd, const char* host, const int port)
 {
+	int chat_sockfd;
 
-	int chat_sockfd = connect_to(host, port);
+	if (port == 0) {
+		chat_sockfd = sockfd;
+	} else {
+		chat_sockfd = connect_to(host, port);
 
-	// * send uid to the server so it can sync
-	char uid_send = (char)GLOBAL_UID;
-	if (send(chat_sockfd, &GLOBAL_UID, 1, 0) < 0) {
-		perror("UID send failure");
+		// * send uid to the server so it can sync
+		if (!send_frame(chat_sockfd, HELLO, GLOBAL_UID, GLOBAL_ROOM_ID, NULL, 0)) {
+			perror("UID send failure");
+		}
 	}
 
-	char user_in[MAX_DATA - 1];
-	char msg[MAX_DATA];
-	char resp[MAX_DATA];
-	int recv_size;
-
-	pthread_t s_thread;
-	pthread_create(&s_thread, NULL, server_response_handler, &chat_sockfd);
-
-	while(true) {
-		// * Get message from client
-		get_message(user_in, MAX_DATA);
-		
-		// * Prepend UID to chat message = {1B UID||NB PAYLOAD}
-		msg[0] = (char) GLOBAL_UID;
-		strcpy(msg + 1, user_in);
-
-		// * Send on sock
-		if (send(chat_sockfd, msg, MAX_DATA, 0) < 0) {
-			puts("Failure on send");
+	// Anything stdio already holds goes out before the loop takes over
+	fflush(stdout);
+
+	char buf[64 * 1024];
+	string in;			// partial frames from the server
+	string line;		// partial line from stdin
+	string display;		// this wakeup's messages
+	struct pollfd pfds[2] = { { chat_sockfd, POLLIN, 0 }, { 0, POLLIN, 0 } };
+	int n_fds = 2;
+	ssize_t n;
+
+	while (true) {
+		if (poll(pfds, n_fds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Failure on poll");
 			exit(1);
 		}
 
-		display_message(resp);
-		cout << '\n';
-		bzero(resp, strlen(resp));
-	}
+		// * drain the socket, then show the whole batch at once
+		if (pfds[0].revents) {
+			bool alive = true;
+			while ((n = recv(chat_sockfd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+				in.append(buf, n);
+			}
+			if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+				alive = false;
+			if (!chat_frames(chat_sockfd, &in, &display))
+				alive = false;
+			if (!display.empty()) {
+				write_all(1, display);
+				display.clear();
+			}
+			if (!alive) {
+				write_all(1, "Server disco!\n");
+				exit(0);
+			}
+		}
 
+		// * stdin is unbuffered (see main), read it in bulk ourselves
+		if (n_fds > 1 && pfds[1].revents) {
+			n = read(0, buf, sizeof(buf));
+			if (n > 0) {
+				line.append(buf, n);
+				chat_lines(chat_sockfd, &line, false);
+			} else if (n == 0 || errno != EINTR) {
+				chat_lines(chat_sockfd, &line, true);
+				n_fds = 1;
+			}
+		}
+	}
 }
-
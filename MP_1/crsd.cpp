@@ -1,200 +1,506 @@
 #include <sys/socket.h>
+#include <sys/signalfd.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
 #include <string>
 #include <vector>
+#include <atomic>
 #include <iostream>
+#include <algorithm>
 #include "interface.h"
+#include "wire.h"
+#include "reactor.h"
+#include "room.h"
+#include "registry.h"
+#include "pool.h"
 
 using namespace std;
 
-/* Macros */
-#define CREATE 	('\x01')
-#define DELETE 	('\x02')
-#define JOIN	('\x03')
-#define LIST	('\x04')
+/* Globals */
 
-#define MAX_ROOMS   (10)
-#define MAX_MEMBERS (20)
+// Our "database", control connections on every loop touch it
+room_registry GLOBAL_ROOMS;
 
-/* Types */
-typedef uint8_t u8;
-typedef uint32_t u32;
+// Rooms are multiplexed over the server port by default, -P restores one
+// listening port per room. In that mode, rather than auto port selecting,
+// we'll increment this start port and map it to room clients
+bool GLOBAL_PER_PORT_ROOMS = false;
+atomic<int> GLOBAL_START_PORT(8090);
 
-struct room {
-private:
-    u8 uid_counter;
+// Room ids tag chat frames, 0 is never handed out
+atomic<u32> GLOBAL_NEXT_ROOM_ID(1);
 
-public:
-    int n_members;
-    int port;
-    int sock;
-    string name;
-    vector<u8> client_UIDs;     // We enforce <256 members so a u8 is large enough
-    vector<int> client_socks;
-    pthread_mutex_t client_lock;
+// Commands run here, off the event loops
+work_pool GLOBAL_POOL;
 
-    room(string _name, int _port) {
-        name = _name;
-        port = _port;
-        uid_counter = 1;        // start at 1 so we don't shadow '\0'
-    }
-    
-    void add_client(int client_sock, u8 client_uid) {
-        // Add to client_socks, client_UIDs, return UID
-        pthread_mutex_lock(&client_lock);
+// A client quiet for this long gets a PING, quiet as long again and it's
+// dropped. 0 turns keepalives off
+int GLOBAL_IDLE_SECS = 30;
+atomic<uint64_t> GLOBAL_PINGS(0);
+atomic<uint64_t> GLOBAL_EVICTED(0);
 
-        ++n_members;
-        sock = client_sock;
-        client_socks.push_back(client_sock);
-        client_UIDs.push_back(client_uid);
-        
-        pthread_mutex_unlock(&client_lock);
-    }
+/* Forwards */
+int master_listen(int port);
+void listener_handler(conn* c, u32 events);
+void control_handler(conn* c, u32 events);
+void room_listener_handler(conn* c, u32 events);
+void member_handler(conn* c, u32 events);
+void signal_handler(conn* c, u32 events);
+void command_done(void* arg);
+void idle_arm(conn* c);
+void idle_expired(void* arg);
+void room_teardown(void* arg);
+
+void usage() {
+    cout << "usage: ./server [-l n_loops] [-w n_workers] [-b epoll|uring] [-P] [-q outq_len] "
+         << "[-s oldest|newest|disconnect] [-r max_rooms] [-m max_members] "
+         << "[-H history_len] [-k replay_len] [-L log_dir] [-i idle_secs] <port>\n";
+    exit(1);
+}
 
-    char get_next_uid() {
-        return (char) uid_counter++;
+int main(int argc, char** argv) {
+    // * parse user input for sock and number of event loops, one per core
+    //   unless told otherwise
+    int n_loops = max(1, (int) sysconf(_SC_NPROCESSORS_ONLN));
+    int opt;
+    while ((opt = getopt(argc, argv, "l:w:b:Pq:s:r:m:H:k:L:i:")) != -1) {
+        switch (opt) {
+            case 'l':
+                n_loops = atoi(optarg);
+                break;
+            case 'w':
+                GLOBAL_N_WORKERS = atoi(optarg);
+                break;
+            case 'b':
+                if (strcmp(optarg, "epoll") == 0) {
+                    GLOBAL_BACKEND = BACKEND_EPOLL;
+                } else if (strcmp(optarg, "uring") == 0) {
+                    GLOBAL_BACKEND = BACKEND_URING;
+                } else {
+                    usage();
+                }
+                break;
+            case 'P':
+                GLOBAL_PER_PORT_ROOMS = true;
+                break;
+            case 'q':
+                GLOBAL_OUTQ_LEN = atoi(optarg);
+                break;
+            case 's':
+                if (strcmp(optarg, "oldest") == 0) {
+                    GLOBAL_SLOW_POLICY = DROP_OLDEST;
+                } else if (strcmp(optarg, "newest") == 0) {
+                    GLOBAL_SLOW_POLICY = DROP_NEWEST;
+                } else if (strcmp(optarg, "disconnect") == 0) {
+                    GLOBAL_SLOW_POLICY = DISCONNECT;
+                } else {
+                    usage();
+                }
+                break;
+            case 'r':
+                GLOBAL_MAX_ROOMS = atoi(optarg);
+                break;
+            case 'm':
+                GLOBAL_MAX_MEMBERS = atoi(optarg);
+                break;
+            case 'H':
+                GLOBAL_HISTORY_LEN = atoi(optarg);
+                break;
+            case 'k':
+                GLOBAL_REPLAY_LEN = atoi(optarg);
+                break;
+            case 'L':
+                GLOBAL_LOG_DIR = optarg;
+                break;
+            case 'i':
+                GLOBAL_IDLE_SECS = atoi(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind != argc - 1 || n_loops < 1 || GLOBAL_N_WORKERS < 1 || GLOBAL_OUTQ_LEN < 1 ||
+            GLOBAL_MAX_ROOMS < 1 || GLOBAL_MAX_MEMBERS < 1 || GLOBAL_MAX_MEMBERS > 255 ||
+            GLOBAL_HISTORY_LEN < 0 || GLOBAL_REPLAY_LEN < 0 || GLOBAL_IDLE_SECS < 0) {
+        usage();
     }
-};
 
-/* Globals */
+    // * a slot per thread that can touch a room's counters
+    GLOBAL_STATS_SLOTS = min(n_loops + GLOBAL_N_WORKERS, STATS_SLOTS);
 
-// Our "database"
-vector<room*> GLOBAL_ROOM_TABLE;
+    // Peers vanishing mid-send must not kill the server
+    signal(SIGPIPE, SIG_IGN);
 
-// Rather than auto port selecting, we'll increment this start port
-// and map it to room clients
-int GLOBAL_START_PORT = 8090;
+    // SIGUSR1 dumps counters, it's read from a signalfd on loop 0 so block
+    // it before any loop thread exists
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+    int sig_fd = signalfd(-1, &sigs, 0);
 
-/* Forwards */
-void* connection_handler(void* _sock);
+    // * init event loops, each with its own master socket on the same port,
+    //   the kernel spreads incoming connections over them
+    int sock_in = atoi(argv[optind]);
+    for (int i = 0; i < n_loops; i++) {
+        GLOBAL_LOOPS.push_back(loop_init(i));
 
-int main(int argc, char** argv) {
-    // * parse user input for sock
-    if (argc != 2) {
-        cout << "Error, input socket number\n";
-        exit(1);
+        int socket_desc = master_listen(sock_in);
+        if (conn_add(socket_desc, CONN_LISTENER, listener_handler, GLOBAL_LOOPS[i]) == nullptr) {
+            exit(1);
+        }
+    }
+    if (sig_fd < 0 || conn_add(sig_fd, CONN_SIGNAL, signal_handler, GLOBAL_LOOPS[0]) == nullptr) {
+        perror("Failure on signalfd");
+    }
+
+    GLOBAL_POOL.start(GLOBAL_N_WORKERS);
+
+    // * loops 1..N get their own thread, loop 0 runs on this one
+    for (int i = 1; i < n_loops; i++) {
+        if (pthread_create(&GLOBAL_LOOPS[i]->thread, NULL, loop_run, GLOBAL_LOOPS[i])) {
+            perror("Failure on event loop thread creation");
+            exit(1);
+        }
     }
-    
-    // * init master sock
-    int sock_in = atoi(argv[1]);
+    loop_run(GLOBAL_LOOPS[0]);
+
+    return 0;
+}
+
+// One of the SO_REUSEPORT master sockets, exits if the port can't be had
+int master_listen(int port) {
     int socket_desc;
 	if ((socket_desc = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
 		perror("Could not create socket");
+        exit(1);
+    }
+    int on = 1;
+    setsockopt(socket_desc, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (setsockopt(socket_desc, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        perror("Failure on SO_REUSEPORT");
+        exit(1);
     }
 
     // * make the server
-    struct sockaddr_in server, client;
+    struct sockaddr_in server;
     bzero((char*) &server, sizeof(server));
 
 	server.sin_family = AF_INET;
     server.sin_addr.s_addr = inet_addr("127.0.0.1");
-	server.sin_port = htons(sock_in);
+	server.sin_port = htons(port);
 
     // * bind master socket
     if (bind(socket_desc,(struct sockaddr *)&server , sizeof(server)) < 0) {
 		perror("bind failed. Error");
-		return 1;
+		exit(1);
 	}
 
     // * listen for incoming
-    listen(socket_desc, 15);
+    listen(socket_desc, SOMAXCONN);
+    return socket_desc;
+}
 
-    // * accept incoming
+// Accept until EAGAIN, hand back the fd or -1 when drained/closed
+int accept_next(int sock) {
     int client_sock;
-    int* sock_cp;
-    socklen_t csize = sizeof(struct sockaddr);
-    while((client_sock = accept(socket_desc, (struct sockaddr*) &client, &csize))) {
-        if (client_sock < 0) {
+    while (true) {
+        client_sock = accept(sock, NULL, NULL);
+        if (client_sock >= 0)
+            return client_sock;
+        if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+        // EINVAL: room listener was shut down by DELETE
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINVAL)
             perror("Failure on accept");
+        return -1;
+    }
+}
+
+void dump_counters() {
+    cerr << "bytes copied: " << GLOBAL_BYTES_COPIED
+         << ", bytes sent: " << GLOBAL_BYTES_SENT
+         << ", frames dropped: " << GLOBAL_DROPPED << '\n';
+
+    uint64_t n_run = GLOBAL_POOL.n_run;
+    cerr << "commands run: " << n_run
+         << ", refused: " << GLOBAL_POOL.n_refused
+         << ", queue depth: " << GLOBAL_POOL.depth()
+         << " (max " << GLOBAL_POOL.max_depth << ")"
+         << ", wait avg/max us: "
+         << (n_run ? GLOBAL_POOL.wait_ns_total / n_run / 1000 : 0)
+         << "/" << GLOBAL_POOL.wait_ns_max / 1000 << '\n';
+
+    cerr << "keepalive pings: " << GLOBAL_PINGS
+         << ", idle clients dropped: " << GLOBAL_EVICTED << '\n';
+
+    // * completions reaped per io_uring_enter is the batching we get
+    if (GLOBAL_BACKEND == BACKEND_URING) {
+        uint64_t n_enters = 0, n_cqes = 0;
+        for (size_t i = 0; i < GLOBAL_LOOPS.size(); i++) {
+            n_enters += GLOBAL_LOOPS[i]->n_enters;
+            n_cqes += GLOBAL_LOOPS[i]->n_cqes;
         }
+        cerr << "io_uring enters: " << n_enters
+             << ", completions: " << n_cqes << '\n';
+    }
+}
 
-        // * dispatch connection_handler thread
-        sock_cp = new int;//(!) int
-        *sock_cp = client_sock;
+// SIGUSR1 from the signalfd
+void signal_handler(conn* c, u32 events) {
+    struct signalfd_siginfo info;
+    while (read(c->fd, &info, sizeof(info)) == sizeof(info)) {
+        dump_counters();
+    }
+}
 
-        pthread_t s_thread;
-        if (pthread_create(&s_thread, NULL, connection_handler, (void*) sock_cp)) {
-            perror("Failure on connection_handler_thread creation");
-            exit(1);
+// Master socket, control connections stay on the loop that accepted them
+// until they JOIN a room on another loop
+void listener_handler(conn* c, u32 events) {
+    int client_sock;
+    conn* client;
+    while ((client_sock = accept_next(c->fd)) >= 0) {
+        if ((client = conn_add(client_sock, CONN_CONTROL, control_handler, c->loop)) == nullptr) {
+            close(client_sock);
+            continue;
         }
+        idle_arm(client);
     }
-    close(socket_desc);
-    return 0;
 }
 
-// Handle chatroom forwards
-void* msg_forward_handler(void* _room) {
-    
+uint64_t idle_ticks() {
+    return (uint64_t) GLOBAL_IDLE_SECS * 1000 / TIMER_TICK_MS;
+}
+
+// Owning loop, start c's idle clock on its loop's wheel
+void idle_arm(conn* c) {
+    if (GLOBAL_IDLE_SECS == 0)
+        return;
+    c->idle.fn = idle_expired;
+    c->active = c->loop->wheel.now;
+    c->pinged = false;
+    timer_add(&c->loop->wheel, &c->idle, idle_ticks());
+}
+
+// c's idle timer fired, the read path only stamps c->active so this is where
+// we find out whether it was really quiet
+void idle_expired(void* arg) {
+    conn* c = (conn*) arg;
+    timer_wheel* wheel = &c->loop->wheel;
+    uint64_t quiet = wheel->now - c->active;
+
+    // * heard from since (a PING went out a full idle period ago, an answer
+    //   in the same tick counts), sleep until it's been quiet long enough
+    if (quiet < idle_ticks() || (c->pinged && quiet == idle_ticks())) {
+        c->pinged = false;
+        timer_add(wheel, &c->idle, idle_ticks() - quiet);
+        return;
+    }
+    // * a worker has it, the reply will tell us whether it's still there
+    if (c->busy) {
+        timer_add(wheel, &c->idle, idle_ticks());
+        return;
+    }
+    if (!c->pinged) {
+        c->pinged = true;
+        ++GLOBAL_PINGS;
+        string frame = make_frame(PING, 0, 0, "");
+        conn_send(c, frame.data(), frame.length());
+        timer_add(wheel, &c->idle, idle_ticks());
+        return;
+    }
+
+    // * silent through a PING, the shutdown gets it reaped (and out of its
+    //   room) like any other disconnect
+    ++GLOBAL_EVICTED;
+    pthread_mutex_lock(&c->out_lock);
+    conn_kill(c);
+    pthread_mutex_unlock(&c->out_lock);
+}
+
+// Member socket went away, owning loop only
+void member_close(conn* c) {
+    room* chatroom = c->chatroom;
+    if (c->joined) {
+        chatroom->remove_client(c);
+    }
+    conn_close(c);
+    room_put(chatroom);
+}
+
+// Answer a RESEND, payload {4B FIRST||4B LAST}
+void member_resend(conn* c, const char* payload) {
+    room* chatroom = c->chatroom;
+    u32 first, last;
+    vector<msgbuf*> batch;
+
+    memcpy(&first, payload, 4);
+    memcpy(&last, payload + 4, 4);
+    first = ntohl(first);
+    last = ntohl(last);
+
+    // * at most a queue's worth, past that frames count as missing
+    pthread_mutex_lock(&chatroom->client_lock);
+    u32 missing = chatroom->history.range(first, last, GLOBAL_OUTQ_LEN, &batch);
+    for (size_t i = 0; i < batch.size(); i++) {
+        conn_send(c, batch[i], true);
+        msg_put(batch[i]);
+    }
+    if (missing) {
+        string text = to_string(missing) + " of messages " + to_string(first) + "-" +
+                      to_string(last) + " can't be resent";
+        string frame = make_frame(NOTICE, 0, chatroom->id, text);
+        conn_send(c, frame.data(), frame.length());
+    }
+    pthread_mutex_unlock(&chatroom->client_lock);
+}
+
+// Handle every complete frame in c->in, false on a protocol error
+bool member_frames(conn* c) {
+
     /*
-        Expect MSG = {1B UID||NB PAYLOAD}
-        compare UID so we don't echo to the sender
+        HELLO   {UID} once on a per-port room socket, before any MSG
+        MSG     forwarded as-is to every other member, ROOM_ID must be the
+                room this connection joined and the server stamps the UID
+                and the room's next sequence number
+        RESEND  {4B FIRST||4B LAST} queue what history still has of that
+                range, as broadcasts so the slow consumer policy holds
+        The sender is skipped so we don't echo, it gets an ACK with the
+        number instead
     */
 
-    room* chatroom;
-    char buf[MAX_DATA];
-    int room_sock, recv_size, n_members;
-    u8 recv_uid;
-
-    // * cast room from void*
-    chatroom = (room*) _room;
-    room_sock = chatroom->sock;
-
-    // * recv data on sock
-    while((recv_size = recv(room_sock, buf, MAX_DATA, 0)) > 0) {
-        if (recv_size < 0) {
-            perror("Failure on chatroom recv...");
-            exit(1);
+    room* chatroom = c->chatroom;
+    frame_hdr hdr;
+    size_t off = 0;
+    int ok;
+
+    while ((ok = peek_frame(c->in.data() + off, c->in.size() - off, &hdr)) == 1) {
+        char* buf = &c->in[off];
+        size_t frame_len = HDR_LEN + hdr.len;
+        off += frame_len;
+
+        // Per-port rooms take the client UID as the 1st msg for sync
+        if (hdr.type == HELLO && !c->joined) {
+            c->uid = hdr.uid;
+            if (chatroom->add_client(c) <= 0) {
+                return false;
+            }
+            continue;
         }
-        buf[strlen(buf)] = '\0';
-
-        // * extract UID from message
-        // * iterate through room->client_socks and forward messages
-        recv_uid = buf[0];
-        for (int i = 0; i < chatroom->n_members; i++) {
-            
-            // (!) ping to test server connection
-            // ping(chatroom->client_socks[i], 3, 1);//(!!)
-            
-            if (recv_uid != chatroom->client_UIDs[i]) {
-                if (send(chatroom->client_socks[i], buf, sizeof(buf) + 1, 0) < 0) {
-                   perror("Failure msg forward");
-                }
+        if (!c->joined || hdr.room_id != chatroom->id) {
+            continue;
+        }
+        if (hdr.type == RESEND) {
+            if (hdr.len >= 8) {
+                member_resend(c, buf + HDR_LEN);
+            }
+            continue;
+        }
+        if (hdr.type != MSG) {
+            continue;
+        }
+        buf[1] = (char) c->uid;
+        uint64_t start_ns = monotonic_ns();
+
+        // * copy the frame once, every member shares the buffer
+        msgbuf* m = msg_copy(buf, frame_len);
+
+        // * iterate through room->members and forward the frame, then keep
+        //   it for late joiners
+        u32 n_out = 0;
+        uint64_t n_dropped = 0;
+        pthread_mutex_lock(&chatroom->client_lock);
+
+        // * DELETEd, the teardown's notice is the last thing members get
+        if (chatroom->closing) {
+            pthread_mutex_unlock(&chatroom->client_lock);
+            msg_put(m);
+            continue;
+        }
+        u32 seq = chatroom->history.stamp(m);
+        for (int i = 0; i < chatroom->members.size(); i++) {
+            conn* member = chatroom->members[i];
+            // Never blocks, a slow member only fills its own outq, a failed
+            // send shuts the member down and its loop reaps it
+            if (member == c)
+                continue;
+
+            // Only broadcasts are droppable and they all hold client_lock,
+            // so nothing else moves out.dropped while we look at it. A drop
+            // costs the member one delivery, this one or an older one
+            uint64_t dropped = member->out.dropped;
+            bool queued = conn_send(member, m, true);
+            dropped = member->out.dropped - dropped;
+            n_dropped += dropped;
+            if (queued && !dropped) {
+                ++n_out;
             }
         }
+        chatroom->history.record(m);
+
+        // * under the lock too, so c sees its number in order with the rest
+        char ack[HDR_LEN];
+        pack_hdr(ack, ACK, c->uid, chatroom->id, 0, seq);
+        conn_send(c, ack, HDR_LEN);
+        pthread_mutex_unlock(&chatroom->client_lock);
+        msg_put(m);
+        chatroom->stats.record(frame_len, n_out, n_dropped, monotonic_ns() - start_ns);
+    }
+    c->in.erase(0, off);
+    return ok >= 0;
+}
+
+// Chat traffic from a joined client
+void member_handler(conn* c, u32 events) {
+    if (events & EPOLLOUT) {
+        conn_flush(c);
+    }
+    if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        return;
+    }
+
+    // * recv everything available, peer may be gone after the last frame
+    bool alive = conn_read(c);
+
+    if (!member_frames(c) || !alive) {
+        member_close(c);
     }
-    return 0;
 }
 
-void ping(int sock, int n, int slp) {
-    // ping on sock, n times, sleep for slp secs
-    for (int j = 0; j < n; j++) {//(!!)
-        char ping[] = "PING";
-        cout << "Ping " << j << " on sock " << sock << '\n';//(!!)
-        if (send(sock, ping, sizeof(ping) + 1, 0) < 0) {
-            perror("Failure ping");//(!)
+// Room socket, accept members onto this loop
+void room_listener_handler(conn* c, u32 events) {
+    room* chatroom = c->chatroom;
+    int client_sock;
+
+    while ((client_sock = accept_next(c->fd)) >= 0) {
+        conn* member = conn_add(client_sock, CONN_MEMBER, member_handler, c->loop);
+        if (member == nullptr) {
+            close(client_sock);
+            continue;
         }
-        sleep(slp);
+        member->chatroom = chatroom;
+        ++chatroom->refs;
+        idle_arm(member);
+    }
+
+    // * DELETE shuts the listener down, release our ref
+    if (events & (EPOLLHUP | EPOLLERR)) {
+        conn_close(c);
+        room_put(chatroom);
     }
 }
 
-// Create a chatroom
-void* room_handler(void* _room) {
-    room* chatroom;
-    int port, sock, client_sock;
-    string name;
-    char buf[MAX_DATA], resp[MAX_DATA];
-    
-    // * cast room and pull information from void* room
-    chatroom = (room*) _room;
-    port = chatroom->port;
-    name = chatroom->name;
+// Bind the room's port and register it with a loop
+bool room_listen(room* chatroom) {
+    int sock;
 
     // * init sock and server to monitor room->port
     if ( (sock = socket(AF_INET, SOCK_STREAM, 0)) < 0 ) {
         perror("Failure on sock init");
-        exit(1);
+        return false;
     }
     // This is what we were missing in the previous "version" (*)
     // enable local address reuse!
@@ -204,102 +510,102 @@ void* room_handler(void* _room) {
     struct sockaddr_in serv_addr;
 	bzero((char*) &serv_addr, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(port); //(*) must take network byte order!
+    serv_addr.sin_port = htons(chatroom->port); //(*) must take network byte order!
     serv_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-	
+
     // * bind sock to server
     if (bind(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) == -1) {
         perror("Failure on chatroom sock binding");
-        exit(1);
+        close(sock);
+        return false;
     }
 
     // * listen
-    if (listen(sock, 15) != 0) {
-        perror("Failure on bind");
+    if (listen(sock, SOMAXCONN) != 0) {
+        perror("Failure on listen");
+        close(sock);
+        return false;
     }
 
-    // * accept and add client to room->client_socks
-    struct sockaddr_in client_addr;
-    bzero((char*) &client_addr, sizeof(client_addr));
-    socklen_t size = sizeof(client_addr);
-    while((client_sock = accept(sock, (struct sockaddr*)&client_addr, &size))) {
-        if (client_sock < 0) {
-            perror("Error on accept");
-        }
-
-        // Take the client UID as the 1st msg for sync
-        u8 client_uid;
-        if (recv(client_sock, &client_uid, 1, 0) < 0) {
-            perror("Error on recv UID");
-        }
-        chatroom->add_client(client_sock, client_uid);
-        
-        // * dispatch thread to handle room
-        pthread_t s_thread;
-        if(pthread_create(&s_thread, NULL, msg_forward_handler, chatroom)) {
-            perror("Failure on msg_forward_handler thread init");
-            exit(1);
-        }
+    // * hand the socket to the room's loop, the listener holds a room ref
+    conn* c = conn_add(sock, CONN_ROOM_LISTENER, room_listener_handler, chatroom->loop);
+    if (c == nullptr) {
+        close(sock);
+        return false;
     }
-
-    return 0;
-}
-
-room* get_room(string name) {
-    for (int i = 0; i < GLOBAL_ROOM_TABLE.size(); i++) {
-        if (GLOBAL_ROOM_TABLE[i]->name == name) {
-            return GLOBAL_ROOM_TABLE[i];
-        }
-    }
-    return nullptr;
+    ++chatroom->refs;
+    c->chatroom = chatroom;
+    chatroom->sock = c;
+    return true;
 }
 
-// Check if room exists, add to table and start thread
+// Check if room exists, add to the registry and start listening
 char CREATE_resp(string name) {
     room* chatroom;
+    int added;
 
-    // * check if room exists
-    if (get_room(name) != nullptr) {
+    // * cheap check before binding a port, insert below has the final say
+    if ((chatroom = GLOBAL_ROOMS.get(name)) != nullptr) {
+        room_put(chatroom);
         return (char) FAILURE_ALREADY_EXISTS;
     }
 
-    // * check if adding room excedes max
-    if (GLOBAL_ROOM_TABLE.size() >= MAX_ROOMS) {
-        return (char) FAILURE_INVALID;
+    // * per-port rooms bind first, a failed insert just drops the listener
+    //   Rooms are spread over the loops, all of a room's members live on
+    //   its loop so fan-out stays on one core
+    if (GLOBAL_PER_PORT_ROOMS) {
+        chatroom = new room(name, GLOBAL_START_PORT++, GLOBAL_NEXT_ROOM_ID++);
+        chatroom->loop = next_loop();
+        if (!room_listen(chatroom)) {
+            delete chatroom;
+            return (char) FAILURE_UNKNOWN;
+        }
+    } else {
+        chatroom = new room(name, 0, GLOBAL_NEXT_ROOM_ID++);
+        chatroom->loop = next_loop();
+    }
+    if (!GLOBAL_LOG_DIR.empty()) {
+        chatroom->history.open_log(GLOBAL_LOG_DIR, name, chatroom->id);
     }
 
-    // * create new room and add to GLOBAL_ROOM_TABLE
-    chatroom = new room(name, GLOBAL_START_PORT++);
-    GLOBAL_ROOM_TABLE.push_back(chatroom);
-
-    // * dispatch thread to monitor this socket
-    pthread_t s_thread;
-    if(pthread_create(&s_thread, NULL, room_handler, chatroom) != 0) {
-        perror("Thread creation failed");
-        exit(1);
+    // * check if room exists or adding it excedes max
+    added = GLOBAL_ROOMS.insert(chatroom);
+    if (added <= 0 && chatroom->sock) {
+        shutdown(chatroom->sock->fd, SHUT_RDWR);
     }
+    room_put(chatroom);
 
     // * return status code
+    if (added == 0)
+        return (char) FAILURE_ALREADY_EXISTS;
+    if (added < 0)
+        return (char) FAILURE_INVALID;
     return (char) SUCCESS;
 }
 
 // Connecton client to room if valid
-string JOIN_resp(string name) {
+string JOIN_resp(string name, room** joined, u32* room_id) {
     // returns {1B STATUS||1B UID||4B N_MEMBERS||4B PORT}
-    // serialized network byte-order
+    // serialized network byte-order, *room_id is set for the reply frame
+    // PORT=0 means the room is multiplexed, the caller's connection then
+    // switches to chat mode and *joined holds a room ref
     room* chatroom;
     char resp[10];
     int room_port, n_members;
 
-    // * check if room in GLOBAL_ROOM_TABLE
-    if((chatroom = get_room(name)) == nullptr) {
+    *joined = nullptr;
+    *room_id = 0;
+
+    // * check if room in GLOBAL_ROOMS
+    if((chatroom = GLOBAL_ROOMS.get(name)) == nullptr) {
         resp[0] = (char) FAILURE_NOT_EXISTS;
         memset(resp + 1, '\xff', 9);
         return string(resp, 10);
     }
-    
-    // * check if room has space
-    if(chatroom->n_members >= MAX_MEMBERS) {
+
+    // * check if room has space, add_client has the final say
+    if(chatroom->full()) {
+        room_put(chatroom);
         resp[0] = (char) FAILURE_INVALID;
         memset(resp + 1, '\xff', 9);
         return string(resp, 10);
@@ -311,7 +617,15 @@ string JOIN_resp(string name) {
 
     room_port = htonl((u32) chatroom->port);
     n_members = htonl((u32) chatroom->n_members);
-    
+    *room_id = chatroom->id;
+
+    // * multiplexed rooms keep our ref for the joining conn
+    if (chatroom->port == 0) {
+        *joined = chatroom;
+    } else {
+        room_put(chatroom);
+    }
+
     /* ------------------------------------------------- */
     //(!) verify this is portable to C9 (!)
     memcpy(resp + 2, &n_members, 4);//(!)
@@ -323,108 +637,270 @@ string JOIN_resp(string name) {
 
 // List query handler
 string LIST_resp() {
-    string list_str = "";
-    int n_rooms = GLOBAL_ROOM_TABLE.size();
+    // * get room names from GLOBAL_ROOMS, the reply must fit one frame
+    string list_str = GLOBAL_ROOMS.names(MAX_PAYLOAD - 1);
 
-    if (n_rooms == 0) {
+    if (list_str.empty()) {
         return ((char) SUCCESS) + string("NONE");
     }
 
-    // * get room names from GLOBAL_ROOM_TABLE and compose resp string
-    for (int i = 0; i < n_rooms - 1; i++) {
-        list_str += (GLOBAL_ROOM_TABLE[i]->name + ", ");
-    }
-    list_str += GLOBAL_ROOM_TABLE[n_rooms - 1]->name;
-
     // * return resp string
     return ((char) SUCCESS) + list_str;
 }
 
+// Counters for one room, or every room if name is empty
+string STATS_resp(string name) {
+    vector<room*> rooms;
+    if (name.empty()) {
+        GLOBAL_ROOMS.rooms(&rooms);
+    } else {
+        room* chatroom = GLOBAL_ROOMS.get(name);
+        if (chatroom == nullptr)
+            return string(1, (char) FAILURE_NOT_EXISTS);
+        rooms.push_back(chatroom);
+    }
+
+    // * sum each room's per-thread slots, whole rooms only while they fit
+    //   one frame
+    string text;
+    stats_totals totals;
+    for (size_t i = 0; i < rooms.size(); i++) {
+        rooms[i]->stats.sum(&totals);
+        pthread_mutex_lock(&rooms[i]->client_lock);
+        int n_members = rooms[i]->n_members;
+        pthread_mutex_unlock(&rooms[i]->client_lock);
+
+        string entry = stats_format(rooms[i]->name, n_members, totals);
+        if (text.length() + entry.length() < MAX_PAYLOAD)
+            text += entry;
+        room_put(rooms[i]);
+    }
+    if (text.empty()) {
+        text = "NONE\n";
+    }
+    return ((char) SUCCESS) + text;
+}
+
 // Delete query handler
 char DELETE_resp(string name) {
     room* chatroom = nullptr;
-    char warning[] = "Delete request for room received\nClosing...\n";
-    int idx, client_sock;
 
     if (name == "") {
         return (char) FAILURE_INVALID;
     }
 
-    // * check if name in GLOBAL_ROOM_TABLE, save its index
-    for (idx = 0; idx < GLOBAL_ROOM_TABLE.size(); idx++) {
-        if (GLOBAL_ROOM_TABLE[idx]->name == name) {
-            chatroom = GLOBAL_ROOM_TABLE[idx];
-            break;
-        }
-    }
-    if (chatroom == nullptr)
+    // * check if name in GLOBAL_ROOMS, remove it
+    if ((chatroom = GLOBAL_ROOMS.remove(name)) == nullptr)
         return (char) FAILURE_NOT_EXISTS;
 
-    // * send room_close warning to clients
-    for (int i = 0; i < chatroom->n_members; i++) {
-        client_sock = chatroom->client_socks[i];
-        if (send(client_sock, warning, strlen(warning) + 1, 0) < 0) {
-            perror("Failure delete warning send");
-            exit(1);
-        }
-        // * close room sockets
-        close(client_sock);
+    // * no more joiners or broadcasts, and the name (log included) is free
+    //   for a new room right away
+    pthread_mutex_lock(&chatroom->client_lock);
+    chatroom->closing = true;
+    chatroom->history.unlink_log();
+    pthread_mutex_unlock(&chatroom->client_lock);
+
+    // * stop accepting, the listener's loop drops its ref on HUP
+    if (chatroom->sock) {
+        shutdown(chatroom->sock->fd, SHUT_RDWR);
     }
 
-    // * free room pointer and remove elem in GLOBAL_ROOM_TABLE
-    delete chatroom;
-    GLOBAL_ROOM_TABLE.erase(GLOBAL_ROOM_TABLE.begin() + idx);
+    // * warning the members is the room loop's job, our ref goes with it
+    loop_post(chatroom->loop, room_teardown, chatroom);
 
     // * return status code
     return (char) SUCCESS;
 }
 
-// Route command based on string parsing
-// (!) convert return(string) to char[] for speed (!)
-void* connection_handler(void* _sock) {
-    
-    int sock, send_len;
-    char cmd;
-    char msg[MAX_DATA];
-    string resp, name;
-    
-    // * take input from client
-    sock = *(int*) _sock;
-
-    // * recv and route input based on header-byte
-    /*
-        char[] = {1B CMD||NB PAYLOAD||'\0'}
-        (*) Expect incoming buffer to be nullterminated
-        (*) Expect PAYLOAD does not contain \0
-        (*) All outbound resp are nullterminated
-    */
+// Posted by DELETE to the room's loop, which owns its members. Each gets the
+// warning queued behind whatever it's still owed and is closed once that's
+// flushed. Broadcasts run on this loop too, so none is half done here
+void room_teardown(void* arg) {
+    room* chatroom = (room*) arg;
+    char warning[] = "Delete request for room received\nClosing...\n";
+    string frame = make_frame(NOTICE, 0, chatroom->id, warning, strlen(warning));
+    msgbuf* notice = msg_copy(frame.data(), frame.length());
+
+    pthread_mutex_lock(&chatroom->client_lock);
+    for (int i = 0; i < chatroom->members.size(); i++) {
+        conn* member = chatroom->members[i];
+        conn_send(member, notice);
+        conn_shutdown(member);
+    }
+    pthread_mutex_unlock(&chatroom->client_lock);
+    msg_put(notice);
+
+    // * drop DELETE's ref, readers still on an old snapshot and the last
+    //   member out release the rest
+    room_put(chatroom);
+}
 
-    while(recv(sock, msg, MAX_DATA, 0) > 0) {
-        cmd = msg[0];
-        if (cmd != LIST)
-            name = string(msg + 1);
-
-        if (cmd == CREATE) {            // resp={1B STATUS}
-            resp = CREATE_resp(name);
-            send_len = 2;
-        } else if (cmd == DELETE) {     // resp={1B STATUS}
-            resp = DELETE_resp(name);
-            send_len = 2;
-        } else if (cmd == JOIN) {       // resp={1B STATUS||4B PORT||4B N_MEMBERS}
-            resp = JOIN_resp(name);
-            send_len = 10;
-        } else if (cmd == LIST) {       // resp={ROOM1||, ||ROOM2||, ||...}
-            resp = LIST_resp();
-            send_len = resp.length() + 1;
-        } else {
-            resp = string((char) FAILURE_INVALID, 1);
+// A command lent to the worker pool along with its conn
+struct command_task {
+    task base;
+    conn* c;
+    frame_hdr hdr;
+    string name;
+    room* joined;       // multiplexed JOIN, the conn becomes a member
+};
+
+// Worker thread, c is ours until command_done runs on its loop
+void run_command(task* t) {
+    command_task* ct = (command_task*) t;
+    conn* c = ct->c;
+    string resp;
+    room* joined = nullptr;
+    u32 room_id = 0;
+
+    if (ct->hdr.type == CREATE) {            // resp={1B STATUS}
+        resp = CREATE_resp(ct->name);
+    } else if (ct->hdr.type == DELETE) {     // resp={1B STATUS}
+        resp = DELETE_resp(ct->name);
+    } else if (ct->hdr.type == JOIN) {       // resp={1B STATUS||1B UID||4B N_MEMBERS||4B PORT}
+        resp = JOIN_resp(ct->name, &joined, &room_id);
+
+        // * multiplexed room, add_client queues the reply ahead of the
+        //   history replay
+        if (joined) {
+            string frame = make_frame(REPLY, 0, room_id, resp, ct->hdr.tag);
+            msgbuf* greeting = msg_copy(frame.data(), frame.length());
+            int added = joined->add_client(c, greeting);
+            msg_put(greeting);
+            if (added > 0) {
+                c->uid = (u8) resp[1];
+                ct->joined = joined;
+                resp.clear();
+            } else {
+                char status = added < 0 ? FAILURE_INVALID : FAILURE_NOT_EXISTS;
+                resp = string(1, status) + string(9, '\xff');
+                room_put(joined);
+            }
         }
+    } else if (ct->hdr.type == LIST) {       // resp={ROOM1||, ||ROOM2||, ||...}
+        resp = LIST_resp();
+    } else if (ct->hdr.type == STATS) {      // resp={1B STATUS||TEXT}
+        resp = STATS_resp(ct->name);
+    } else {
+        resp = string(1, (char) FAILURE_INVALID);
+    }
 
-        // * send response to client
-        if (send(sock, resp.c_str(), send_len, 0) < 0) {
-            perror("Failure server resp");
+    // * send response to client, unless the JOIN already did
+    if (!resp.empty()) {
+        string frame = make_frame(REPLY, 0, room_id, resp, ct->hdr.tag);
+        conn_send(c, frame.data(), frame.length());
+    }
+
+    // * hand the conn back to its loop
+    loop_post(c->loop, command_done, ct);
+}
+
+// Queue every complete command in c->in, one at a time per conn so replies
+// keep their order. False on a protocol error
+bool control_frames(conn* c) {
+    frame_hdr hdr;
+    size_t off = 0;
+    int ok = 0;
+
+    while (!c->busy && (ok = peek_frame(c->in.data() + off, c->in.size() - off, &hdr)) == 1) {
+        // * keepalive answers only matter for arriving at all
+        if (hdr.type == PONG || hdr.type == PING) {
+            off += HDR_LEN + hdr.len;
+            continue;
+        }
+        command_task* ct = new command_task;
+        ct->base.run = run_command;
+        ct->c = c;
+        ct->hdr = hdr;
+        ct->name = c->in.substr(off + HDR_LEN, hdr.len);
+        ct->joined = nullptr;
+        off += HDR_LEN + hdr.len;
+
+        // * a full queue means we're swamped, say so now rather than queue
+        c->busy = true;
+        if (!GLOBAL_POOL.submit(&ct->base)) {
+            c->busy = false;
+            string frame = make_frame(REPLY, 0, 0, string(1, (char) FAILURE_UNKNOWN), hdr.tag);
+            conn_send(c, frame.data(), frame.length());
+            delete ct;
         }
     }
+    c->in.erase(0, off);
+    return ok >= 0;
+}
 
-    return 0;
+// Owning loop, carry on with whatever input is buffered
+void control_input(conn* c, bool alive) {
+
+    // * after a JOIN everything else is chat traffic
+    if (c->type == CONN_MEMBER) {
+        if (!member_frames(c) || !alive) {
+            member_close(c);
+        }
+        return;
+    }
+
+    bool ok = control_frames(c);
+    if (c->busy) {
+        c->peer_gone = c->peer_gone || !alive || !ok;
+    } else if (!alive || !ok) {
+        conn_close(c);
+    }
+}
+
+// Posted to the room's loop, a member moving in from another loop
+void member_adopt(void* arg) {
+    conn* c = (conn*) arg;
+    if (!conn_watch(c)) {
+        member_close(c);
+        return;
+    }
+    idle_arm(c);
+    control_input(c, !c->peer_gone);
+}
+
+// Posted by a worker once it's done with the conn
+void command_done(void* arg) {
+    command_task* ct = (command_task*) arg;
+    conn* c = ct->c;
+
+    c->busy = false;
+    if (ct->joined) {
+        c->type = CONN_MEMBER;
+        c->handler = member_handler;
+        c->chatroom = ct->joined;
+    }
+    delete ct;
+
+    // * members live on their room's loop, hand c over if it isn't ours
+    if (c->chatroom && c->chatroom->loop != c->loop) {
+        conn_move(c, c->chatroom->loop, member_adopt);
+        return;
+    }
+    control_input(c, !c->peer_gone);
+}
+
+// Route command frames by type
+void control_handler(conn* c, u32 events) {
+
+    if (events & EPOLLOUT) {
+        conn_flush(c);
+    }
+    if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        return;
+    }
+    bool alive = conn_read(c);
+
+    // * recv and route input based on frame type
+    /*
+        {TYPE=CMD||ROOM_ID=0||TAG||NAME}, answered with {TYPE=REPLY||...||TAG||1B STATUS||...}
+        (*) A read may hold several commands or half of one, clients pipeline
+            and match replies on TAG
+        (*) Commands run on the worker pool, while one is out the rest wait
+            in c->in and a close waits for the worker
+    */
+    if (c->busy) {
+        c->peer_gone = c->peer_gone || !alive;
+        return;
+    }
+    control_input(c, alive);
 }
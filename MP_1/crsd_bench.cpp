@@ -0,0 +1,408 @@
+/*
+    crsd_bench, load generator for crsd
+
+    Spawns N synthetic clients spread over M rooms, each sends MSG frames at
+    a fixed rate and reads the fan-out from everyone else in its room. Every
+    message carries its send time, so each delivery gives one end-to-end
+    latency sample (sender's send -> member's recv, both on this host).
+
+    Reports messages sent and delivered per second, fan-out latency
+    percentiles and, given the server's pid, its CPU use over the run.
+
+    The server must allow the rooms and members we ask for, e.g.
+        ./server -l 4 -r 16 -m 64 8080 &
+        ./crsd_bench -n 256 -m 16 -r 50 -s 128 -d 10 -p $! 127.0.0.1 8080
+
+    `make bench_compare` runs that load against -b epoll then -b uring.
+*/
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <iostream>
+#include "interface.h"
+#include "wire.h"
+
+using namespace std;
+
+/* Macros */
+#define HIST_SUB    (16)                // linear buckets per power of two
+#define HIST_LEN    (64 * HIST_SUB)
+#define MAX_EVENTS  (256)
+
+/* Types */
+struct bench_client {
+    int sock;
+    u8 uid;
+    u32 room_id;
+    pthread_mutex_t send_lock;  // sender's MSGs vs receiver's PONGs, and lost
+    bool lost;              // closed by the server, or a send failed
+    string in;              // partial frames, receiver thread only
+};
+
+/* Globals */
+int GLOBAL_N_CLIENTS = 16;
+int GLOBAL_N_ROOMS = 4;
+double GLOBAL_RATE = 10;                // msgs/sec per client
+int GLOBAL_MSG_SIZE = 64;               // payload bytes, at least a timestamp
+int GLOBAL_DURATION = 5;                // seconds of sending
+int GLOBAL_SERVER_PID = 0;
+
+vector<bench_client> GLOBAL_CLIENTS;
+atomic<bool> GLOBAL_DONE(false);
+atomic<uint64_t> GLOBAL_SENT(0);
+atomic<uint64_t> GLOBAL_RECVD(0);
+uint64_t GLOBAL_REPLAYED = 0;           // history from an earlier run, receiver thread only
+uint64_t GLOBAL_JOINED;                 // when the JOINs started
+atomic<int> GLOBAL_LOST(0);             // clients the server dropped mid-run
+uint64_t GLOBAL_HIST[HIST_LEN];         // latency ns, receiver thread only
+
+void usage() {
+    cout << "usage: ./crsd_bench [-n clients] [-m rooms] [-r msgs/sec per client] "
+         << "[-s msg_size] [-d seconds] [-p server_pid] <host> <port>\n";
+    exit(1);
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Log-linear buckets: HIST_SUB per power of two, ~6% resolution
+int hist_bucket(uint64_t v) {
+    if (v < HIST_SUB)
+        return (int) v;
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - 4;
+    return (shift + 1) * HIST_SUB + (int) ((v >> shift) - HIST_SUB);
+}
+
+uint64_t hist_value(int b) {
+    if (b < HIST_SUB)
+        return b;
+    int shift = b / HIST_SUB - 1;
+    return ((uint64_t) (b % HIST_SUB + HIST_SUB) << shift) + ((1ull << shift) >> 1);
+}
+
+uint64_t hist_percentile(double p) {
+    uint64_t total = 0, seen = 0;
+    for (int i = 0; i < HIST_LEN; i++)
+        total += GLOBAL_HIST[i];
+    if (total == 0)
+        return 0;
+    uint64_t want = (uint64_t) (p * total);
+    for (int i = 0; i < HIST_LEN; i++) {
+        seen += GLOBAL_HIST[i];
+        if (seen > want)
+            return hist_value(i);
+    }
+    return hist_value(HIST_LEN - 1);
+}
+
+// utime + stime of pid in seconds, -1 if we can't read it
+double proc_cpu(int pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+
+    char buf[1024];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+
+    // comm may hold spaces, fields after it are space separated from 3 on
+    char* p = strrchr(buf, ')');
+    unsigned long utime, stime;
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                            &utime, &stime) != 2)
+        return -1;
+    return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+int connect_to(const char* host, int port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("Failure on socket");
+        exit(1);
+    }
+    struct sockaddr_in server;
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_addr.s_addr = inet_addr(host);
+    server.sin_port = htons(port);
+    if (connect(sock, (struct sockaddr*) &server, sizeof(server)) < 0) {
+        perror("Failure on connect");
+        exit(1);
+    }
+    int on = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return sock;
+}
+
+// One command on a control connection, returns the reply payload
+string command(int sock, u8 type, const string& name, frame_hdr* hdr) {
+    string payload;
+    if (!send_frame(sock, type, 0, 0, name.data(), name.length(), 1) ||
+            !recv_frame(sock, hdr, &payload) || hdr->type != REPLY || hdr->len < 1) {
+        cerr << "Failure on command to server\n";
+        exit(1);
+    }
+    return payload;
+}
+
+string room_name(int i) {
+    return "bench" + to_string(i);
+}
+
+// Create the rooms then connect and JOIN every client
+void setup(const char* host, int port) {
+    frame_hdr hdr;
+    int ctl = connect_to(host, port);
+    for (int i = 0; i < GLOBAL_N_ROOMS; i++) {
+        string resp = command(ctl, CREATE, room_name(i), &hdr);
+        if (resp[0] != SUCCESS && resp[0] != FAILURE_ALREADY_EXISTS) {
+            cerr << "Failure creating " << room_name(i) << ", check the server's -r\n";
+            exit(1);
+        }
+    }
+    close(ctl);
+
+    // * JOIN replays the room's history, anything stamped before now is an
+    //   earlier run's
+    GLOBAL_JOINED = now_ns();
+    GLOBAL_CLIENTS.resize(GLOBAL_N_CLIENTS);
+    for (int i = 0; i < GLOBAL_N_CLIENTS; i++) {
+        bench_client& c = GLOBAL_CLIENTS[i];
+        pthread_mutex_init(&c.send_lock, NULL);
+        c.lost = false;
+        c.sock = connect_to(host, port);
+        string resp = command(c.sock, JOIN, room_name(i % GLOBAL_N_ROOMS), &hdr);
+        if (resp[0] != SUCCESS || resp.length() < 10) {
+            cerr << "Failure joining " << room_name(i % GLOBAL_N_ROOMS)
+                 << ", check the server's -m\n";
+            exit(1);
+        }
+        c.uid = (u8) resp[1];
+        c.room_id = hdr.room_id;
+
+        // * per-port (-P) rooms are a second connection
+        u32 room_port;
+        memcpy(&room_port, &resp[6], 4);
+        room_port = ntohl(room_port);
+        if (room_port != 0) {
+            close(c.sock);
+            c.sock = connect_to(host, room_port);
+            send_frame(c.sock, HELLO, c.uid, c.room_id, NULL, 0);
+        }
+    }
+}
+
+// send_lock held. Stop sending as c, once
+void lose(bench_client* c) {
+    if (!c->lost) {
+        c->lost = true;
+        ++GLOBAL_LOST;
+    }
+}
+
+// Paces every client's sends off one clock, a lost client's turns are
+// skipped
+void* sender(void*) {
+    string payload(GLOBAL_MSG_SIZE, 'x');
+    double interval = 1e9 / (GLOBAL_RATE * GLOBAL_N_CLIENTS);
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t) GLOBAL_DURATION * 1000000000ull;
+    uint64_t k = 0;
+
+    while (true) {
+        uint64_t due = start + (uint64_t) (k * interval);
+        uint64_t now = now_ns();
+        if (due >= end)
+            break;
+        if (due > now) {
+            struct timespec ts = { 0, (long) (due - now) };
+            nanosleep(&ts, NULL);
+        }
+
+        // * payload = {8B SEND TIME||padding}, stamped as late as possible
+        bench_client& c = GLOBAL_CLIENTS[k % GLOBAL_N_CLIENTS];
+        uint64_t t = now_ns();
+        memcpy(&payload[0], &t, sizeof(t));
+        pthread_mutex_lock(&c.send_lock);
+        bool sent = !c.lost &&
+            send_frame(c.sock, MSG, c.uid, c.room_id, payload.data(), payload.length());
+        if (!sent) {
+            lose(&c);
+        }
+        pthread_mutex_unlock(&c.send_lock);
+        if (GLOBAL_LOST == GLOBAL_N_CLIENTS) {
+            cerr << "Failure on send, server gone?\n";
+            exit(1);
+        }
+        GLOBAL_SENT += sent;
+        ++k;
+    }
+    return 0;
+}
+
+// Drain every client socket, one latency sample per MSG frame sent this
+// run (JOIN replays older ones from the room's history). A PING is
+// answered so a client sending less than once per server -i isn't evicted.
+// A socket the server closed is taken out of the epoll set, it'd be
+// readable (EOF) forever
+void* receiver(void*) {
+    int epfd = epoll_create1(0);
+    for (int i = 0; i < GLOBAL_N_CLIENTS; i++) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &GLOBAL_CLIENTS[i];
+        epoll_ctl(epfd, EPOLL_CTL_ADD, GLOBAL_CLIENTS[i].sock, &ev);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    char buf[65536];
+    while (!GLOBAL_DONE) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, 100);
+        for (int i = 0; i < n; i++) {
+            bench_client* c = (bench_client*) events[i].data.ptr;
+            ssize_t got = recv(c->sock, buf, sizeof(buf), MSG_DONTWAIT);
+            if (got < 0 && (errno == EAGAIN || errno == EINTR))
+                continue;
+            if (got <= 0) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, c->sock, NULL);
+                pthread_mutex_lock(&c->send_lock);
+                lose(c);
+                pthread_mutex_unlock(&c->send_lock);
+                cerr << "Client " << c - &GLOBAL_CLIENTS[0] << " lost: "
+                     << (got == 0 ? "closed by server" : strerror(errno)) << '\n';
+                continue;
+            }
+            c->in.append(buf, got);
+
+            uint64_t now = now_ns();
+            frame_hdr hdr;
+            size_t off = 0;
+            while (peek_frame(c->in.data() + off, c->in.size() - off, &hdr) == 1) {
+                if (hdr.type == MSG && hdr.len >= sizeof(uint64_t)) {
+                    uint64_t t;
+                    memcpy(&t, c->in.data() + off + HDR_LEN, sizeof(t));
+                    if (t < GLOBAL_JOINED) {
+                        ++GLOBAL_REPLAYED;
+                    } else {
+                        ++GLOBAL_HIST[hist_bucket(now > t ? now - t : 0)];
+                        ++GLOBAL_RECVD;
+                    }
+                } else if (hdr.type == PING) {
+                    pthread_mutex_lock(&c->send_lock);
+                    send_frame(c->sock, PONG, c->uid, c->room_id, NULL, 0);
+                    pthread_mutex_unlock(&c->send_lock);
+                }
+                off += HDR_LEN + hdr.len;
+            }
+            c->in.erase(0, off);
+        }
+    }
+    close(epfd);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:m:r:s:d:p:")) != -1) {
+        switch (opt) {
+            case 'n':
+                GLOBAL_N_CLIENTS = atoi(optarg);
+                break;
+            case 'm':
+                GLOBAL_N_ROOMS = atoi(optarg);
+                break;
+            case 'r':
+                GLOBAL_RATE = atof(optarg);
+                break;
+            case 's':
+                GLOBAL_MSG_SIZE = atoi(optarg);
+                break;
+            case 'd':
+                GLOBAL_DURATION = atoi(optarg);
+                break;
+            case 'p':
+                GLOBAL_SERVER_PID = atoi(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind != argc - 2 || GLOBAL_N_CLIENTS < 1 || GLOBAL_N_ROOMS < 1 || GLOBAL_RATE <= 0
+            || GLOBAL_DURATION < 1 || GLOBAL_MSG_SIZE > MAX_PAYLOAD) {
+        usage();
+    }
+    if (GLOBAL_MSG_SIZE < (int) sizeof(uint64_t)) {
+        GLOBAL_MSG_SIZE = sizeof(uint64_t);
+    }
+
+    // * a client the server dropped is reported, not fatal
+    signal(SIGPIPE, SIG_IGN);
+
+    // * rooms and clients, then let the last JOINs settle
+    setup(argv[optind], atoi(argv[optind + 1]));
+    usleep(200000);
+
+    // * run, then give in-flight fan-out a moment to arrive
+    pthread_t s_thread, r_thread;
+    double cpu_start = GLOBAL_SERVER_PID ? proc_cpu(GLOBAL_SERVER_PID) : -1;
+    uint64_t start = now_ns();
+
+    pthread_create(&r_thread, NULL, receiver, NULL);
+    pthread_create(&s_thread, NULL, sender, NULL);
+    pthread_join(s_thread, NULL);
+    double send_secs = (now_ns() - start) / 1e9;
+    usleep(500000);
+    GLOBAL_DONE = true;
+    pthread_join(r_thread, NULL);
+
+    double wall_secs = (now_ns() - start) / 1e9;
+    double cpu_end = GLOBAL_SERVER_PID ? proc_cpu(GLOBAL_SERVER_PID) : -1;
+
+    // * report
+    printf("clients %d, rooms %d, rate %.1f/s per client, size %d B, %d s\n",
+           GLOBAL_N_CLIENTS, GLOBAL_N_ROOMS, GLOBAL_RATE, GLOBAL_MSG_SIZE, GLOBAL_DURATION);
+    printf("sent      %lu msgs, %.0f msgs/sec\n",
+           (unsigned long) GLOBAL_SENT.load(), GLOBAL_SENT / send_secs);
+    printf("delivered %lu msgs, %.0f msgs/sec\n",
+           (unsigned long) GLOBAL_RECVD.load(), GLOBAL_RECVD / send_secs);
+    if (GLOBAL_REPLAYED > 0) {
+        printf("replayed  %lu msgs from an earlier run, not counted\n",
+               (unsigned long) GLOBAL_REPLAYED);
+    }
+    if (GLOBAL_LOST > 0) {
+        printf("lost      %d of %d clients, dropped by the server\n",
+               GLOBAL_LOST.load(), GLOBAL_N_CLIENTS);
+    }
+    printf("latency   p50 %.1f us, p99 %.1f us, p999 %.1f us\n",
+           hist_percentile(0.50) / 1e3, hist_percentile(0.99) / 1e3,
+           hist_percentile(0.999) / 1e3);
+    if (cpu_start >= 0 && cpu_end >= 0) {
+        printf("server    %.2f s cpu, %.1f%% of one core\n",
+               cpu_end - cpu_start, 100 * (cpu_end - cpu_start) / wall_secs);
+    }
+
+    for (int i = 0; i < GLOBAL_N_CLIENTS; i++) {
+        close(GLOBAL_CLIENTS[i].sock);
+    }
+    return 0;
+}
@@ -0,0 +1,247 @@
+/*
+    Per-room message history
+
+    Each room keeps the last GLOBAL_HISTORY_LEN chat frames in a ring of
+    msgbuf references. The ring holds the same buffer the broadcast just
+    queued on every member, so recording a message is a refcount bump and a
+    slot swap, no copy and, once the ring has been sized, no allocation. A
+    member that JOINs gets the newest GLOBAL_REPLAY_LEN of them queued ahead
+    of any live traffic.
+
+    Every chat frame is numbered as it's broadcast, the number rides in the
+    frame's TAG, so the ring always holds a run of consecutive numbers and
+    RESEND finds a frame by arithmetic. Numbers carry on from a reloaded log.
+
+    With -L <dir> every frame is also appended to <dir>/<room name>.log, a
+    file mmap'd MAP_SHARED so an append is a memcpy, the kernel writes it
+    back. A room created under a name that already has a log starts with its
+    tail in the ring. The log grows by doubling and goes away on DELETE.
+
+    The owning room's client_lock guards all of it.
+*/
+#ifndef HISTORY_H_
+#define HISTORY_H_
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "msgbuf.h"
+#include "wire.h"
+
+#define LOG_INIT_CAP (1 << 20)      // bytes, doubled as needed
+
+/* Globals */
+int GLOBAL_HISTORY_LEN = 128;       // -H, frames kept per room, 0 disables
+int GLOBAL_REPLAY_LEN = 32;         // -k, frames replayed on JOIN
+std::string GLOBAL_LOG_DIR;         // -L, empty for memory only
+
+struct room_history {
+    std::vector<msgbuf*> ring;
+    size_t next;                    // slot the next frame goes in
+    size_t count;
+    u32 next_seq;                   // number for the next frame
+
+    // Append-only log, unused when fd < 0
+    int fd;
+    std::string path;
+    char* map;
+    size_t cap;
+    size_t used;
+
+    room_history() {
+        next = 0;
+        count = 0;
+        next_seq = 1;
+        fd = -1;
+        map = nullptr;
+        cap = 0;
+        used = 0;
+        ring.assign(GLOBAL_HISTORY_LEN, nullptr);
+    }
+    ~room_history() {
+        for (size_t i = 0; i < ring.size(); i++) {
+            if (ring[i])
+                msg_put(ring[i]);
+        }
+        close_log();
+    }
+
+    // Number frame m, before it goes anywhere
+    u32 stamp(msgbuf* m) {
+        u32 seq = next_seq++;
+        set_tag(m->data, seq);
+        return seq;
+    }
+
+    // Keep a reference to frame m, stamp(...)ed, and log it. The log
+    // doesn't depend on the ring, -H 0 -L <dir> keeps a log and no history
+    void record(msgbuf* m) {
+        log_append(m->data, m->len);
+        if (ring.empty())
+            return;
+        msg_get(m);
+        if (ring[next])
+            msg_put(ring[next]);
+        ring[next] = m;
+        next = (next + 1) % ring.size();
+        if (count < ring.size())
+            ++count;
+    }
+
+    // The newest n frames, oldest first, each with a ref for the caller
+    void newest(size_t n, std::vector<msgbuf*>* out) {
+        n = std::min(n, count);
+        for (size_t i = 0; i < n; i++) {
+            msgbuf* m = ring[(next + ring.size() - n + i) % ring.size()];
+            msg_get(m);
+            out->push_back(m);
+        }
+    }
+
+    /*
+     * Frames numbered first..last still in the ring, oldest first, each with
+     * a ref for the caller, at most max of them
+     *
+     * @return how many of first..last (clipped to numbers handed out so far)
+     *         are left out, no longer kept or past max
+     */
+    u32 range(u32 first, u32 last, size_t max, std::vector<msgbuf*>* out) {
+        last = std::min(last, next_seq - 1);
+        if (first == 0 || first > last)
+            return 0;
+        u32 want = last - first + 1;
+        if (count == 0)
+            return want;
+
+        frame_hdr hdr;
+        size_t oldest = (next + ring.size() - count) % ring.size();
+        unpack_hdr(ring[oldest]->data, &hdr);
+        u32 oldest_seq = hdr.tag;
+        u32 sent = 0;
+        for (u32 seq = std::max(first, oldest_seq); seq <= last && sent < max; seq++) {
+            u32 i = seq - oldest_seq;
+            if (i >= count)
+                break;
+            msgbuf* m = ring[(oldest + i) % ring.size()];
+
+            // * frames from a log that predates numbering have none
+            unpack_hdr(m->data, &hdr);
+            if (hdr.tag != seq)
+                continue;
+            msg_get(m);
+            out->push_back(m);
+            ++sent;
+        }
+        return want - sent;
+    }
+
+    /*
+     * Open (or create) the log for a room, loading the tail of an existing
+     * one into the ring with its frames restamped for room_id
+     *
+     * @return false if the file can't be mapped, the room then runs without
+     */
+    bool open_log(const std::string& dir, const std::string& name, u32 room_id) {
+        path = dir + "/" + log_name(name);
+        if ((fd = open(path.c_str(), O_RDWR | O_CREAT, 0644)) < 0) {
+            perror("Failure on history log open");
+            return false;
+        }
+        struct stat st;
+        fstat(fd, &st);
+        cap = std::max((size_t) st.st_size, (size_t) LOG_INIT_CAP);
+        if (ftruncate(fd, cap) < 0 ||
+                (map = (char*) mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0))
+                == MAP_FAILED) {
+            perror("Failure on history log mmap");
+            map = nullptr;
+            close(fd);
+            fd = -1;
+            return false;
+        }
+
+        // * frames run until the zeroed tail, a torn last frame is dropped
+        frame_hdr hdr;
+        std::vector<size_t> offs;
+        while (peek_frame(map + used, cap - used, &hdr) == 1 && hdr.type != 0) {
+            offs.push_back(used);
+            used += HDR_LEN + hdr.len;
+            if (hdr.tag >= next_seq)
+                next_seq = hdr.tag + 1;
+        }
+        size_t first = offs.size() > ring.size() ? offs.size() - ring.size() : 0;
+        for (size_t i = first; i < offs.size() && !ring.empty(); i++) {
+            unpack_hdr(map + offs[i], &hdr);
+            msgbuf* m = msg_copy(map + offs[i], HDR_LEN + hdr.len);
+            pack_hdr(m->data, hdr.type, hdr.uid, room_id, hdr.len, hdr.tag);
+            ring[next] = m;
+            next = (next + 1) % ring.size();
+            ++count;
+        }
+        return true;
+    }
+
+    void log_append(const char* buf, size_t len) {
+        if (map == nullptr)
+            return;
+        if (used + len > cap && !log_grow(used + len))
+            return;
+        memcpy(map + used, buf, len);
+        used += len;
+    }
+
+    bool log_grow(size_t want) {
+        size_t new_cap = cap;
+        while (new_cap < want)
+            new_cap *= 2;
+        char* new_map;
+        if (ftruncate(fd, new_cap) < 0 ||
+                (new_map = (char*) mremap(map, cap, new_cap, MREMAP_MAYMOVE)) == MAP_FAILED) {
+            perror("Failure growing history log");
+            return false;
+        }
+        map = new_map;
+        cap = new_cap;
+        return true;
+    }
+
+    void close_log() {
+        if (map)
+            munmap(map, cap);
+        if (fd >= 0)
+            close(fd);
+        map = nullptr;
+        fd = -1;
+    }
+
+    // The room is gone for good, so is its log. Only the name goes now, so a
+    // new room can take it, the mapping is released with the room
+    void unlink_log() {
+        if (fd >= 0)
+            unlink(path.c_str());
+    }
+
+    // Room names are client input, keep [A-Za-z0-9_-] and %XX the rest
+    static std::string log_name(const std::string& name) {
+        std::string out;
+        char hex[4];
+        for (size_t i = 0; i < name.length(); i++) {
+            unsigned char ch = name[i];
+            if (isalnum(ch) || ch == '_' || ch == '-') {
+                out += ch;
+            } else {
+                snprintf(hex, sizeof(hex), "%%%02X", ch);
+                out += hex;
+            }
+        }
+        return out + ".log";
+    }
+};
+
+#endif // HISTORY_H_
@@ -0,0 +1,131 @@
+/*
+    Pooled, refcounted message buffers
+
+    A chat frame is copied out of the sender's input buffer into one msgbuf,
+    then every member's outq holds a reference to that same msgbuf and writes
+    it with sendmsg/writev. Fan-out to N members costs one (pooled) allocation
+    and one copy per message instead of N.
+
+    Buffers are recycled per size class on free lists, so steady state traffic
+    doesn't touch the allocator. Anything bigger than the largest class is
+    plain new/delete.
+
+    GLOBAL_BYTES_COPIED vs GLOBAL_BYTES_SENT shows how well this is working,
+    for a room of N members sent/copied should approach N-1.
+*/
+#ifndef MSGBUF_H_
+#define MSGBUF_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <new>
+
+#define N_SIZE_CLASSES  (5)
+#define POOL_MAX_FREE   (1024)      // per class, beyond this we free
+
+const uint32_t SIZE_CLASSES[N_SIZE_CLASSES] = { 256, 1024, 4096, 16384, 65536 + 64 };
+
+struct msgbuf {
+    std::atomic<int> refs;
+    uint32_t len;
+    int size_class;         // -1 if not pooled
+    msgbuf* next_free;
+    char* data;             // points just past the struct
+};
+
+struct msg_pool {
+    pthread_mutex_t lock;
+    msgbuf* free_list;
+    int n_free;
+};
+
+/* Globals */
+msg_pool GLOBAL_POOLS[N_SIZE_CLASSES] = {
+    { PTHREAD_MUTEX_INITIALIZER, nullptr, 0 },
+    { PTHREAD_MUTEX_INITIALIZER, nullptr, 0 },
+    { PTHREAD_MUTEX_INITIALIZER, nullptr, 0 },
+    { PTHREAD_MUTEX_INITIALIZER, nullptr, 0 },
+    { PTHREAD_MUTEX_INITIALIZER, nullptr, 0 },
+};
+std::atomic<uint64_t> GLOBAL_BYTES_COPIED(0);   // bytes copied into msgbufs
+std::atomic<uint64_t> GLOBAL_BYTES_SENT(0);     // bytes written to sockets
+
+int size_class_of(uint32_t len) {
+    for (int i = 0; i < N_SIZE_CLASSES; i++) {
+        if (len <= SIZE_CLASSES[i])
+            return i;
+    }
+    return -1;
+}
+
+msgbuf* msg_new(uint32_t cap, int size_class) {
+    char* raw = new char[sizeof(msgbuf) + cap];
+    msgbuf* m = new (raw) msgbuf;
+    m->size_class = size_class;
+    m->data = raw + sizeof(msgbuf);
+    return m;
+}
+
+void msg_delete(msgbuf* m) {
+    m->~msgbuf();
+    delete[] (char*) m;
+}
+
+// Fresh buffer with room for len bytes and a single reference
+msgbuf* msg_alloc(uint32_t len) {
+    msgbuf* m = nullptr;
+    int sc = size_class_of(len);
+
+    if (sc >= 0) {
+        msg_pool& pool = GLOBAL_POOLS[sc];
+        pthread_mutex_lock(&pool.lock);
+        if ((m = pool.free_list) != nullptr) {
+            pool.free_list = m->next_free;
+            --pool.n_free;
+        }
+        pthread_mutex_unlock(&pool.lock);
+    }
+    if (m == nullptr) {
+        m = msg_new(sc >= 0 ? SIZE_CLASSES[sc] : len, sc);
+    }
+    m->refs = 1;
+    m->len = len;
+    return m;
+}
+
+// Buffer holding a copy of buf
+msgbuf* msg_copy(const char* buf, uint32_t len) {
+    msgbuf* m = msg_alloc(len);
+    memcpy(m->data, buf, len);
+    GLOBAL_BYTES_COPIED += len;
+    return m;
+}
+
+void msg_get(msgbuf* m) {
+    m->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Drop a reference, the last one returns the buffer to its pool
+void msg_put(msgbuf* m) {
+    if (m->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+
+    if (m->size_class >= 0) {
+        msg_pool& pool = GLOBAL_POOLS[m->size_class];
+        pthread_mutex_lock(&pool.lock);
+        if (pool.n_free < POOL_MAX_FREE) {
+            m->next_free = pool.free_list;
+            pool.free_list = m;
+            ++pool.n_free;
+            m = nullptr;
+        }
+        pthread_mutex_unlock(&pool.lock);
+    }
+    if (m) {
+        msg_delete(m);
+    }
+}
+
+#endif // MSGBUF_H_
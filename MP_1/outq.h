@@ -0,0 +1,170 @@
+/*
+    Bounded per-connection outbound queue
+
+    A fixed ring of whole frames waiting to be written to one socket. Slots
+    hold references to shared msgbufs (msgbuf.h), a room broadcast queues the
+    same buffer on every member, and a flush hands as many queued frames as
+    fit to a single sendmsg. Room fan-out only ever appends here and never
+    blocks on a socket, so a slow member costs the room one queue slot per
+    message instead of stalling delivery to every member after it.
+
+    When a member falls GLOBAL_OUTQ_LEN frames behind, GLOBAL_SLOW_POLICY
+    decides what gives:
+        DROP_OLDEST     discard the oldest frame not yet started on the wire
+        DROP_NEWEST     discard the frame being queued
+        DISCONNECT      drop the member
+
+    Only room broadcasts are droppable. Replies and notices are forced in, a
+    few spare slots are kept for them, if even those are full the peer isn't
+    reading at all and is disconnected.
+*/
+#ifndef OUTQ_H_
+#define OUTQ_H_
+
+#include <sys/uio.h>
+#include <stdint.h>
+#include <vector>
+#include <atomic>
+#include "msgbuf.h"
+
+#define OUTQ_RESERVE (16)       // extra slots for forced frames
+#define OUTQ_IOV     (64)       // frames handed to one sendmsg
+
+enum slow_policy {
+    DROP_OLDEST,
+    DROP_NEWEST,
+    DISCONNECT
+};
+
+/* Globals */
+int GLOBAL_OUTQ_LEN = 256;
+slow_policy GLOBAL_SLOW_POLICY = DROP_OLDEST;
+std::atomic<uint64_t> GLOBAL_DROPPED(0);     // frames dropped across all conns
+
+struct outq_slot {
+    msgbuf* m;
+    uint32_t off;           // frame starts at m->data + off
+    bool droppable;
+};
+
+struct outq {
+    std::vector<outq_slot> slots;
+    size_t head;
+    size_t count;
+    size_t head_off;        // bytes of the head frame already on the wire
+    size_t pinned;          // frames from head handed to an in-flight io_uring
+                            // send, the kernel may still be reading them
+    uint64_t dropped;
+
+    // Slots are only allocated once something has to be queued, most conns
+    // (listeners, idle clients) never need them
+    outq() {
+        head = 0;
+        count = 0;
+        head_off = 0;
+        pinned = 0;
+        dropped = 0;
+    }
+    ~outq() {
+        clear();
+    }
+
+    bool empty() const { return count == 0; }
+
+    outq_slot& at(size_t i) { return slots[(head + i) % slots.size()]; }
+
+    // Fill iov with the unwritten bytes of up to max queued frames
+    int gather(struct iovec* iov, int max) {
+        int n = 0;
+        for (size_t i = 0; i < count && n < max; i++, n++) {
+            outq_slot& s = at(i);
+            size_t skip = i ? 0 : head_off;
+            iov[n].iov_base = s.m->data + s.off + skip;
+            iov[n].iov_len = s.m->len - s.off - skip;
+        }
+        return n;
+    }
+
+    // n bytes from the front of the queue were written
+    void advance(size_t n) {
+        while (n && count) {
+            outq_slot& s = at(0);
+            size_t left = s.m->len - s.off - head_off;
+            if (n < left) {
+                head_off += n;
+                return;
+            }
+            n -= left;
+            msg_put(s.m);
+            s.m = nullptr;
+            head = (head + 1) % slots.size();
+            --count;
+            head_off = 0;
+        }
+    }
+
+    // Remove the i'th queued frame, shifting later ones up, overload path only
+    void erase(size_t i) {
+        msg_put(at(i).m);
+        for (; i + 1 < count; i++) {
+            at(i) = at(i + 1);
+        }
+        at(count - 1).m = nullptr;
+        --count;
+    }
+
+    // Drop the oldest droppable frame that hasn't started on the wire
+    bool drop_oldest() {
+        size_t first = head_off ? 1 : 0;
+        for (size_t i = first > pinned ? first : pinned; i < count; i++) {
+            if (at(i).droppable) {
+                erase(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /*
+     * Queue m->data[off..len), takes its own reference on m
+     *
+     * @return  1 queued,
+     *          0 dropped under DROP_OLDEST/DROP_NEWEST,
+     *         -1 peer is too far behind and must be disconnected
+     */
+    int push(msgbuf* m, uint32_t off, bool droppable) {
+        if (droppable && count >= (size_t) GLOBAL_OUTQ_LEN) {
+            ++dropped;
+            ++GLOBAL_DROPPED;
+            if (GLOBAL_SLOW_POLICY == DISCONNECT)
+                return -1;
+            if (GLOBAL_SLOW_POLICY == DROP_NEWEST || !drop_oldest())
+                return 0;
+        }
+        if (slots.empty())
+            slots.resize(GLOBAL_OUTQ_LEN + OUTQ_RESERVE);
+        if (count == slots.size())
+            return -1;
+
+        outq_slot& s = at(count);
+        msg_get(m);
+        s.m = m;
+        s.off = off;
+        s.droppable = droppable;
+        ++count;
+        return 1;
+    }
+
+    // Release everything not pinned, newest first
+    void clear() {
+        while (count > pinned) {
+            msg_put(at(count - 1).m);
+            at(count - 1).m = nullptr;
+            --count;
+        }
+        if (count == 0)
+            head_off = 0;
+    }
+};
+
+#endif // OUTQ_H_
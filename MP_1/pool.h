@@ -0,0 +1,130 @@
+/*
+    Fixed-size worker pool for crsd commands
+
+    Event loops only parse frames, CREATE/DELETE/JOIN/LIST run on one of
+    GLOBAL_N_WORKERS threads fed from a bounded queue. A burst of slow
+    commands (room setup, DELETE fan-out) then never stalls the chat traffic
+    sharing a loop, and a connection storm fills the queue instead of the
+    process: once WORK_QUEUE_LEN tasks are waiting, submit refuses and the
+    caller answers the command as busy right away.
+
+    Counters, dumped with the others on SIGUSR1:
+        queue depth now and at its peak, tasks run and refused,
+        mean and worst time a task waited in the queue
+*/
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <atomic>
+#include <deque>
+#include <vector>
+
+#define WORK_QUEUE_LEN (1024)
+
+struct task;
+typedef void (*task_fn)(task* t);
+
+// Embed as the first member of the real work item
+struct task {
+    task_fn run;
+    uint64_t queued_ns;
+};
+
+/* Globals */
+int GLOBAL_N_WORKERS = 2;
+
+uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct work_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    std::deque<task*> queue;
+    std::vector<pthread_t> threads;
+
+    // Metrics
+    size_t max_depth;
+    std::atomic<uint64_t> n_run;
+    std::atomic<uint64_t> n_refused;
+    std::atomic<uint64_t> wait_ns_total;
+    std::atomic<uint64_t> wait_ns_max;
+
+    work_pool() {
+        pthread_mutex_init(&lock, NULL);
+        pthread_cond_init(&ready, NULL);
+        max_depth = 0;
+        n_run = 0;
+        n_refused = 0;
+        wait_ns_total = 0;
+        wait_ns_max = 0;
+    }
+
+    void start(int n_workers) {
+        threads.resize(n_workers);
+        for (int i = 0; i < n_workers; i++) {
+            if (pthread_create(&threads[i], NULL, worker_run, this)) {
+                perror("Failure on worker thread creation");
+                exit(1);
+            }
+        }
+    }
+
+    // Thread safe, false if the queue is full and t was not taken
+    bool submit(task* t) {
+        t->queued_ns = monotonic_ns();
+        pthread_mutex_lock(&lock);
+        if (queue.size() >= WORK_QUEUE_LEN) {
+            pthread_mutex_unlock(&lock);
+            ++n_refused;
+            return false;
+        }
+        queue.push_back(t);
+        if (queue.size() > max_depth)
+            max_depth = queue.size();
+        pthread_cond_signal(&ready);
+        pthread_mutex_unlock(&lock);
+        return true;
+    }
+
+    size_t depth() {
+        pthread_mutex_lock(&lock);
+        size_t n = queue.size();
+        pthread_mutex_unlock(&lock);
+        return n;
+    }
+
+    void record_wait(uint64_t waited) {
+        wait_ns_total += waited;
+        uint64_t seen = wait_ns_max;
+        while (waited > seen && !wait_ns_max.compare_exchange_weak(seen, waited))
+            ;
+    }
+
+    static void* worker_run(void* _pool) {
+        work_pool* pool = (work_pool*) _pool;
+        task* t;
+        while (true) {
+            pthread_mutex_lock(&pool->lock);
+            while (pool->queue.empty())
+                pthread_cond_wait(&pool->ready, &pool->lock);
+            t = pool->queue.front();
+            pool->queue.pop_front();
+            pthread_mutex_unlock(&pool->lock);
+
+            pool->record_wait(monotonic_ns() - t->queued_ns);
+            ++pool->n_run;
+            t->run(t);
+        }
+        return 0;
+    }
+};
+
+#endif // POOL_H_
@@ -0,0 +1,873 @@
+/*
+    Edge-triggered epoll reactor for crsd
+
+    Every socket the server owns (master listener, control connections, room
+    listeners and room members) is wrapped in a conn and registered with exactly
+    one event_loop. A loop is one thread blocked in epoll_wait, so N loops means
+    N threads regardless of how many clients are connected.
+
+    Ownership rules, which keep this lock-light:
+        - Only the owning loop reads from, closes or frees a conn
+        - Any thread may conn_send(...) to a conn, its bounded outq (outq.h)
+          is guarded by out_lock and never blocks the sender
+        - Other threads ask for a close with conn_shutdown(...), the owning loop
+          then sees EOF/HUP and does the actual cleanup
+        - Other threads hand work (or a whole conn) to a loop with
+          loop_post(...), a lock-free MPSC list, the callback runs on the
+          loop's thread (woken through an eventfd)
+        - A conn moves between loops by its owner calling conn_move(...),
+          the new loop gets it posted and conn_watch(...)es it
+        - While busy is set a worker (pool.h) is handling one of the conn's
+          commands, the loop keeps reading into in but leaves the rest of the
+          conn alone until the worker posts it back
+
+    Sockets are registered once with EPOLLIN|EPOLLOUT|EPOLLET, so handlers must
+    drain reads until EAGAIN and only rely on EPOLLOUT after a send hit EAGAIN.
+
+    With -b uring each loop drives an io_uring (uring.h) instead. Handlers and
+    everything above them are unchanged, the reactor turns completions back
+    into the same handler calls:
+        - Control and member conns keep one RECV in flight, its completion
+          appends to in and calls the handler with EPOLLIN (plus EPOLLRDHUP at
+          EOF), conn_read(...) then has nothing left to do
+        - Listeners, the signalfd and the eventfd keep a one-shot POLL_ADD
+        - conn_send(...) only queues, conns with new output are flushed once
+          per loop pass with one SENDMSG each, and every SQE from the pass
+          goes to the kernel in the same io_uring_enter that waits for the
+          next completions
+        - In-flight ops hold a reference on their conn, conn_close(...) shuts
+          the socket down so they complete and the last one frees it
+
+    Each loop also ticks a timer wheel (timer.h) off a timerfd every
+    TIMER_TICK_MS, every conn carries an idle timer on its loop's wheel and
+    the tick its last input arrived on.
+*/
+#ifndef REACTOR_H_
+#define REACTOR_H_
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "outq.h"
+#include "uring.h"
+#include "timer.h"
+
+#define MAX_EVENTS  (256)
+#define READ_CHUNK  (4096)
+#define URING_LEN   (4096)      // SQ entries per loop
+
+// io_uring user_data is the conn with the op in the low bits
+#define URING_POLL      (1)
+#define URING_RECV      (2)
+#define URING_SEND      (3)
+#define URING_CANCEL    (4)     // no conn, nothing to do on completion
+#define URING_OP_MASK   (7)
+
+struct room;
+struct conn;
+struct event_loop;
+
+enum conn_type {
+    CONN_LISTENER,          // master socket, accepts control connections
+    CONN_CONTROL,           // CREATE/DELETE/JOIN/LIST
+    CONN_ROOM_LISTENER,     // per-room socket, accepts room members
+    CONN_MEMBER,            // joined client, chat traffic
+    CONN_SIGNAL,            // signalfd, SIGUSR1 dumps counters
+    CONN_WAKE,              // eventfd, runs callbacks posted to the loop
+    CONN_TIMER              // timerfd, ticks the loop's timer wheel
+};
+
+enum io_backend {
+    BACKEND_EPOLL,          // readiness, handlers do their own syscalls
+    BACKEND_URING           // completions, see above
+};
+
+typedef void (*conn_handler)(conn* c, uint32_t events);
+typedef void (*loop_fn)(void* arg);
+
+struct posted_fn {
+    loop_fn fn;
+    void* arg;
+    posted_fn* next;
+};
+
+struct event_loop {
+    int id;
+    int epfd;
+    pthread_t thread;
+
+    // Callbacks from other threads, run by this loop. Producers push onto
+    // the list with a CAS, the loop takes the whole list at once
+    int wake_fd;
+    bool woken;
+    std::atomic<posted_fn*> posted;
+
+    timer_wheel wheel;
+
+    // io_uring backend, conns with output to flush on the next pass
+    uring ring;
+    std::vector<conn*> dirty;
+    uint64_t n_enters;
+    uint64_t n_cqes;
+};
+
+// io_uring backend state, owning loop only unless noted
+struct conn_io {
+    char rx[READ_CHUNK];            // the in-flight RECV lands here
+    struct iovec iov[OUTQ_IOV];     // the in-flight SENDMSG, its frames are
+    struct msghdr msg;              // pinned in out until it completes
+    int ops;                        // SQEs in flight
+    bool rx_armed;
+    bool rx_eof;
+    bool tx_armed;                  // out_lock
+    bool tx_scheduled;              // out_lock, a flush is on its way
+    bool closed;
+    event_loop* move_to;            // set while handing the conn over
+    loop_fn move_fn;
+};
+
+struct conn {
+    int fd;
+    conn_type type;
+    conn_handler handler;
+    event_loop* loop;
+
+    // Room state, only used by CONN_ROOM_LISTENER and CONN_MEMBER
+    room* chatroom;
+    uint8_t uid;
+    bool joined;
+
+    // Partial input, only touched by the owning loop
+    std::string in;
+
+    // A worker has one of our commands, close is deferred until it's back
+    bool busy;
+    bool peer_gone;
+
+    // Idle detection, owning loop only. The timer lives on loop's wheel
+    timer idle;
+    uint64_t active;        // wheel tick of the last input
+    bool pinged;            // keepalive sent, no input since
+
+    // Pending output, any thread may append
+    outq out;
+    bool close_pending;     // shutdown once out is drained
+    pthread_mutex_t out_lock;
+
+    // The owning loop holds one, io_uring ops in flight one each
+    std::atomic<int> refs;
+    conn_io* io;
+
+    conn(int _fd, conn_type _type, conn_handler _handler, event_loop* _loop) {
+        fd = _fd;
+        type = _type;
+        handler = _handler;
+        loop = _loop;
+        chatroom = nullptr;
+        uid = 0;
+        joined = false;
+        busy = false;
+        peer_gone = false;
+        timer_init(&idle, nullptr, this);
+        active = 0;
+        pinged = false;
+        close_pending = false;
+        pthread_mutex_init(&out_lock, NULL);
+        refs = 1;
+        io = nullptr;
+    }
+    ~conn() {
+        pthread_mutex_destroy(&out_lock);
+        delete io;
+    }
+};
+
+/* Globals */
+std::vector<event_loop*> GLOBAL_LOOPS;
+std::atomic<unsigned> GLOBAL_NEXT_LOOP(0);
+io_backend GLOBAL_BACKEND = BACKEND_EPOLL;     // -b
+thread_local event_loop* CURRENT_LOOP = nullptr;
+
+/* Forwards */
+void uring_watch(conn* c);
+void uring_watch_posted(void* arg);
+void uring_hand_over(conn* c);
+void uring_cancel(conn* c, int op);
+void loop_post(event_loop* loop, loop_fn fn, void* arg);
+
+void conn_get(conn* c) {
+    ++c->refs;
+}
+
+void conn_put(conn* c) {
+    if (--c->refs == 0) {
+        delete c;
+    }
+}
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Frames are written whole as soon as they're ready, don't let Nagle hold a
+// small one back waiting on the peer's (delayed) ACK of the last
+int set_nodelay(int fd) {
+    int on = 1;
+    return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+// Round robin new sockets across loops
+event_loop* next_loop() {
+    return GLOBAL_LOOPS[GLOBAL_NEXT_LOOP++ % GLOBAL_LOOPS.size()];
+}
+
+// Register c with c->loop, also how a loop adopts a conn another loop let
+// go of, edge triggered epoll reports whatever is already pending on ADD
+bool conn_watch(conn* c) {
+    if (GLOBAL_BACKEND == BACKEND_URING) {
+        // * SQEs only go on the owning loop's ring, from its thread
+        if (CURRENT_LOOP == c->loop) {
+            uring_watch(c);
+        } else {
+            conn_get(c);
+            loop_post(c->loop, uring_watch_posted, c);
+        }
+        return true;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(c->loop->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        perror("Failure on epoll_ctl add");
+        return false;
+    }
+    return true;
+}
+
+// Wrap fd in a conn and register it with loop, fd is made non-blocking
+conn* conn_add(int fd, conn_type type, conn_handler handler, event_loop* loop) {
+    if (set_nonblocking(fd) < 0) {
+        perror("Failure on set_nonblocking");
+        return nullptr;
+    }
+    if (type == CONN_CONTROL || type == CONN_MEMBER) {
+        set_nodelay(fd);
+    }
+    conn* c = new conn(fd, type, handler, loop);
+    if (GLOBAL_BACKEND == BACKEND_URING) {
+        c->io = new conn_io;
+        memset(c->io, 0, sizeof(*c->io));
+    }
+    if (!conn_watch(c)) {
+        delete c;
+        return nullptr;
+    }
+    return c;
+}
+
+// Eventfd readable, posted callbacks run once the current batch of events is
+// dispatched since they may close conns that still have an event in it
+void wake_handler(conn* c, uint32_t events) {
+    uint64_t n;
+    while (read(c->fd, &n, sizeof(n)) == sizeof(n))
+        ;
+    c->loop->woken = true;
+}
+
+// Timerfd readable, catch the wheel up on every tick since the last
+void tick_handler(conn* c, uint32_t events) {
+    uint64_t n;
+    while (read(c->fd, &n, sizeof(n)) == sizeof(n)) {
+        while (n--)
+            timer_tick(&c->loop->wheel);
+    }
+}
+
+void loop_run_posted(event_loop* loop) {
+    loop->woken = false;
+
+    // * the list is newest first, flip it to run in post order
+    posted_fn* p = loop->posted.exchange(nullptr, std::memory_order_acquire);
+    posted_fn* todo = nullptr;
+    while (p) {
+        posted_fn* next = p->next;
+        p->next = todo;
+        todo = p;
+        p = next;
+    }
+    while (todo) {
+        posted_fn* next = todo->next;
+        todo->fn(todo->arg);
+        delete todo;
+        todo = next;
+    }
+}
+
+// Thread safe and lock-free, fn(arg) runs on loop's thread
+void loop_post(event_loop* loop, loop_fn fn, void* arg) {
+    posted_fn* p = new posted_fn;
+    p->fn = fn;
+    p->arg = arg;
+    p->next = loop->posted.load(std::memory_order_relaxed);
+    while (!loop->posted.compare_exchange_weak(p->next, p, std::memory_order_release,
+                                               std::memory_order_relaxed))
+        ;
+
+    // * only the post onto an empty list needs to wake the loop, the rest
+    //   are picked up with it
+    uint64_t one = 1;
+    if (p->next == nullptr && write(loop->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("Failure on loop wakeup");
+    }
+}
+
+/*
+ * Owning loop, hand c to another loop. Once this loop is done with it
+ * fn(c) runs on the new loop, which should conn_watch(...) it
+ */
+void conn_move(conn* c, event_loop* to, loop_fn fn) {
+    // * timers are per loop, the new one re-arms it
+    timer_del(&c->loop->wheel, &c->idle);
+
+    if (GLOBAL_BACKEND == BACKEND_URING) {
+        // * wait out the ops in flight, the last completion hands c over
+        c->io->move_to = to;
+        c->io->move_fn = fn;
+        if (c->io->ops == 0) {
+            uring_hand_over(c);
+        } else if (c->io->rx_armed) {
+            uring_cancel(c, URING_RECV);
+        }
+        return;
+    }
+
+    epoll_ctl(c->loop->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    pthread_mutex_lock(&c->out_lock);
+    c->loop = to;
+    pthread_mutex_unlock(&c->out_lock);
+    loop_post(to, fn, c);
+}
+
+event_loop* loop_init(int id) {
+    event_loop* loop = new event_loop;
+    loop->id = id;
+    loop->epfd = -1;
+    if (GLOBAL_BACKEND == BACKEND_URING) {
+        if (!uring_init(&loop->ring, URING_LEN)) {
+            perror("Failure on io_uring_setup");
+            exit(1);
+        }
+    } else if ((loop->epfd = epoll_create1(0)) < 0) {
+        perror("Failure on epoll_create1");
+        exit(1);
+    }
+    loop->n_enters = 0;
+    loop->n_cqes = 0;
+    loop->woken = false;
+    loop->posted = nullptr;
+    if ((loop->wake_fd = eventfd(0, EFD_NONBLOCK)) < 0 ||
+            conn_add(loop->wake_fd, CONN_WAKE, wake_handler, loop) == nullptr) {
+        perror("Failure on eventfd");
+        exit(1);
+    }
+
+    timer_wheel_init(&loop->wheel);
+    struct itimerspec tick;
+    tick.it_interval.tv_sec = 0;
+    tick.it_interval.tv_nsec = TIMER_TICK_MS * 1000000L;
+    tick.it_value = tick.it_interval;
+    int tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (tick_fd < 0 || timerfd_settime(tick_fd, 0, &tick, NULL) < 0 ||
+            conn_add(tick_fd, CONN_TIMER, tick_handler, loop) == nullptr) {
+        perror("Failure on timerfd");
+        exit(1);
+    }
+    return loop;
+}
+
+// Owning loop only
+void conn_close(conn* c) {
+    timer_del(&c->loop->wheel, &c->idle);
+    if (GLOBAL_BACKEND == BACKEND_URING) {
+        // * closing the fd alone leaves ops in flight, the shutdown ends them
+        c->io->closed = true;
+        shutdown(c->fd, SHUT_RDWR);
+    } else {
+        epoll_ctl(c->loop->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    }
+    close(c->fd);
+    conn_put(c);
+}
+
+// Read everything available into c->in
+// Return false if the peer is gone and the conn should be closed
+bool conn_read(conn* c) {
+    // * the RECV completion already appended it
+    if (GLOBAL_BACKEND == BACKEND_URING)
+        return !c->io->rx_eof;
+
+    char buf[READ_CHUNK];
+    ssize_t n;
+    while (true) {
+        n = recv(c->fd, buf, sizeof(buf), 0);
+        if (n > 0) {
+            c->in.append(buf, n);
+            c->active = c->loop->wheel.now;
+            continue;
+        }
+        if (n == 0)
+            return false;
+        if (errno == EINTR)
+            continue;
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+}
+
+// Write as much of iov as the socket takes, caller holds out_lock
+// Return bytes written, -1 on a hard error
+ssize_t send_iov(int fd, struct iovec* iov, int n) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = n;
+
+    ssize_t sent;
+    while (true) {
+        sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent >= 0) {
+            GLOBAL_BYTES_SENT += sent;
+            return sent;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        return -1;
+    }
+}
+
+// Give up on a conn, caller holds out_lock
+void conn_kill(conn* c) {
+    c->close_pending = true;
+    c->out.clear();
+    shutdown(c->fd, SHUT_RDWR);
+}
+
+// Write queued frames until the socket is full, caller holds out_lock
+void outq_drain(conn* c) {
+    struct iovec iov[OUTQ_IOV];
+    size_t want;
+    ssize_t sent;
+    int n;
+    while (!c->out.empty()) {
+        n = c->out.gather(iov, OUTQ_IOV);
+        want = 0;
+        for (int i = 0; i < n; i++)
+            want += iov[i].iov_len;
+
+        if ((sent = send_iov(c->fd, iov, n)) < 0) {
+            conn_kill(c);
+            return;
+        }
+        c->out.advance(sent);
+        if ((size_t) sent < want)
+            return;
+    }
+}
+
+/* io_uring backend */
+
+// Next SQE on the owning loop's ring, the op holds a ref on c until it completes
+struct io_uring_sqe* uring_op(conn* c, int op) {
+    struct io_uring_sqe* sqe = uring_sqe(&c->loop->ring);
+    if (sqe == nullptr) {
+        perror("Failure on io_uring submit");
+        exit(1);
+    }
+    sqe->user_data = (uint64_t) c | op;
+    ++c->io->ops;
+    conn_get(c);
+    return sqe;
+}
+
+void uring_arm_poll(conn* c) {
+    struct io_uring_sqe* sqe = uring_op(c, URING_POLL);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = c->fd;
+    sqe->poll32_events = POLLIN;
+}
+
+void uring_arm_recv(conn* c) {
+    struct io_uring_sqe* sqe = uring_op(c, URING_RECV);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t) c->io->rx;
+    sqe->len = sizeof(c->io->rx);
+    c->io->rx_armed = true;
+}
+
+// Caller holds out_lock
+void uring_arm_send(conn* c) {
+    conn_io* io = c->io;
+    int n = c->out.gather(io->iov, OUTQ_IOV);
+    c->out.pinned = n;
+    memset(&io->msg, 0, sizeof(io->msg));
+    io->msg.msg_iov = io->iov;
+    io->msg.msg_iovlen = n;
+
+    struct io_uring_sqe* sqe = uring_op(c, URING_SEND);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t) &io->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    io->tx_armed = true;
+}
+
+// Best effort, whatever op of c's it hits completes with -ECANCELED
+void uring_cancel(conn* c, int op) {
+    struct io_uring_sqe* sqe = uring_sqe(&c->loop->ring);
+    if (sqe == nullptr)
+        return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t) c | op;
+    sqe->user_data = URING_CANCEL;
+}
+
+// Send whatever is queued unless a send is already out, caller holds out_lock
+void uring_tx_kick(conn* c) {
+    conn_io* io = c->io;
+    if (!io->closed && !io->move_to && !io->tx_armed && !c->out.empty())
+        uring_arm_send(c);
+}
+
+// Owning loop, c is on our dirty list or was posted to us
+void uring_tx_posted(void* arg) {
+    conn* c = (conn*) arg;
+    pthread_mutex_lock(&c->out_lock);
+
+    // * moved on since, follow it
+    if (c->loop != CURRENT_LOOP) {
+        loop_post(c->loop, uring_tx_posted, c);
+        pthread_mutex_unlock(&c->out_lock);
+        return;
+    }
+    c->io->tx_scheduled = false;
+    uring_tx_kick(c);
+    pthread_mutex_unlock(&c->out_lock);
+    conn_put(c);
+}
+
+// Any thread, flush c on its loop's next pass, caller holds out_lock
+void uring_schedule_tx(conn* c) {
+    conn_io* io = c->io;
+    if (io->tx_scheduled || io->tx_armed)
+        return;
+    io->tx_scheduled = true;
+    conn_get(c);
+    if (CURRENT_LOOP == c->loop) {
+        c->loop->dirty.push_back(c);
+    } else {
+        loop_post(c->loop, uring_tx_posted, c);
+    }
+}
+
+// Owning loop, arm whatever c needs
+void uring_watch(conn* c) {
+    conn_io* io = c->io;
+    if (io->closed)
+        return;
+    if (c->type != CONN_CONTROL && c->type != CONN_MEMBER) {
+        uring_arm_poll(c);
+        return;
+    }
+    if (!io->rx_eof && !io->rx_armed)
+        uring_arm_recv(c);
+    pthread_mutex_lock(&c->out_lock);
+    uring_tx_kick(c);
+    pthread_mutex_unlock(&c->out_lock);
+}
+
+void uring_watch_posted(void* arg) {
+    conn* c = (conn*) arg;
+    uring_watch(c);
+    conn_put(c);
+}
+
+// Owning loop, nothing in flight any more, give c to io->move_to
+void uring_hand_over(conn* c) {
+    event_loop* to = c->io->move_to;
+    loop_fn fn = c->io->move_fn;
+    c->io->move_to = nullptr;
+
+    pthread_mutex_lock(&c->out_lock);
+    c->loop = to;
+    pthread_mutex_unlock(&c->out_lock);
+    loop_post(to, fn, c);
+}
+
+// Owning loop, one completion
+void uring_complete(struct io_uring_cqe* cqe) {
+    int op = cqe->user_data & URING_OP_MASK;
+    if (op == URING_CANCEL)
+        return;
+    conn* c = (conn*) (cqe->user_data & ~(uint64_t) URING_OP_MASK);
+    conn_io* io = c->io;
+    int res = cqe->res;
+    --io->ops;
+
+    switch (op) {
+        case URING_POLL:
+            if (io->closed)
+                break;
+            c->handler(c, res < 0 ? EPOLLERR : res);
+            if (!io->closed && res >= 0)
+                uring_arm_poll(c);
+            break;
+
+        case URING_RECV:
+            io->rx_armed = false;
+            if (res > 0) {
+                c->in.append(io->rx, res);
+                c->active = c->loop->wheel.now;
+            } else if (res != -ECANCELED && res != -EINTR && res != -EAGAIN) {
+                io->rx_eof = true;
+            }
+            if (io->closed)
+                break;
+            // * mid move, the new loop deals with whatever came in
+            if (io->move_to) {
+                c->peer_gone = c->peer_gone || io->rx_eof;
+                break;
+            }
+            c->handler(c, EPOLLIN | (io->rx_eof ? EPOLLRDHUP : 0));
+            if (!io->closed && !io->move_to && !io->rx_eof && !io->rx_armed)
+                uring_arm_recv(c);
+            break;
+
+        case URING_SEND:
+            pthread_mutex_lock(&c->out_lock);
+            io->tx_armed = false;
+            c->out.pinned = 0;
+            if (res >= 0) {
+                GLOBAL_BYTES_SENT += res;
+                c->out.advance(res);
+            } else if (res != -EINTR && res != -EAGAIN) {
+                conn_kill(c);
+            }
+            if (!c->out.empty()) {
+                uring_tx_kick(c);
+            } else if (c->close_pending && !io->closed) {
+                shutdown(c->fd, SHUT_RDWR);
+            }
+            pthread_mutex_unlock(&c->out_lock);
+            break;
+    }
+
+    if (io->move_to && io->ops == 0)
+        uring_hand_over(c);
+    conn_put(c);
+}
+
+void* uring_loop_run(event_loop* loop) {
+    std::vector<conn*> dirty;
+    struct io_uring_cqe* cqe;
+
+    // * conns added before the loop started, the eventfd's own poll included
+    loop_run_posted(loop);
+
+    while (true) {
+        // * one SENDMSG per conn with new output, submitted with the wait
+        dirty.swap(loop->dirty);
+        for (size_t i = 0; i < dirty.size(); i++) {
+            uring_tx_posted(dirty[i]);
+        }
+        dirty.clear();
+
+        if (uring_enter(&loop->ring, 1) < 0 && errno != EBUSY) {
+            perror("Failure on io_uring_enter");
+            exit(1);
+        }
+        ++loop->n_enters;
+
+        // * handlers may close their own conn, its ops keep it alive
+        while ((cqe = uring_peek_cqe(&loop->ring)) != nullptr) {
+            struct io_uring_cqe done = *cqe;
+            uring_cqe_seen(&loop->ring);
+            ++loop->n_cqes;
+            uring_complete(&done);
+        }
+        if (loop->woken) {
+            loop_run_posted(loop);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Thread safe send of one whole frame, never blocks. If the socket can't take
+ * it now a reference to m is queued and flushed by the owning loop on EPOLLOUT
+ *
+ * @parameter droppable  room broadcasts, subject to GLOBAL_SLOW_POLICY
+ *
+ * @return false if the conn is (now) being closed
+ */
+bool conn_send(conn* c, msgbuf* m, bool droppable = false) {
+    pthread_mutex_lock(&c->out_lock);
+
+    // * already on its way out, the owning loop will reap it
+    if (c->close_pending) {
+        pthread_mutex_unlock(&c->out_lock);
+        return false;
+    }
+
+    // * io_uring: queue it, the owning loop sends what piled up in one go
+    if (GLOBAL_BACKEND == BACKEND_URING) {
+        bool ok = c->out.push(m, 0, droppable) >= 0;
+        if (ok) {
+            uring_schedule_tx(c);
+        } else {
+            conn_kill(c);
+        }
+        pthread_mutex_unlock(&c->out_lock);
+        return ok;
+    }
+
+    // * nothing queued ahead of us, try the socket first
+    ssize_t sent = 0;
+    if (c->out.empty()) {
+        struct iovec iov = { m->data, m->len };
+        if ((sent = send_iov(c->fd, &iov, 1)) < 0) {
+            conn_kill(c);
+            pthread_mutex_unlock(&c->out_lock);
+            return false;
+        }
+        if ((size_t) sent == m->len) {
+            pthread_mutex_unlock(&c->out_lock);
+            return true;
+        }
+        // a frame that's partly on the wire must go out whole
+        if (sent > 0)
+            droppable = false;
+    }
+
+    // * queue the rest, slow consumers hit the policy here
+    if (c->out.push(m, sent, droppable) < 0) {
+        conn_kill(c);
+        pthread_mutex_unlock(&c->out_lock);
+        return false;
+    }
+
+    pthread_mutex_unlock(&c->out_lock);
+    return true;
+}
+
+/*
+ * Thread safe send of several whole frames in order, queued together and
+ * flushed with as few sendmsg calls as they take. None are droppable, so
+ * callers keep n within GLOBAL_OUTQ_LEN
+ *
+ * @return false if the conn is (now) being closed
+ */
+bool conn_send_batch(conn* c, const std::vector<msgbuf*>& ms) {
+    pthread_mutex_lock(&c->out_lock);
+
+    if (c->close_pending) {
+        pthread_mutex_unlock(&c->out_lock);
+        return false;
+    }
+    for (size_t i = 0; i < ms.size(); i++) {
+        if (c->out.push(ms[i], 0, false) < 0) {
+            conn_kill(c);
+            pthread_mutex_unlock(&c->out_lock);
+            return false;
+        }
+    }
+    if (GLOBAL_BACKEND == BACKEND_URING) {
+        uring_schedule_tx(c);
+    } else {
+        outq_drain(c);
+    }
+
+    bool ok = !c->close_pending;
+    pthread_mutex_unlock(&c->out_lock);
+    return ok;
+}
+
+// One-off frames (replies, notices), copied into their own msgbuf
+bool conn_send(conn* c, const char* buf, size_t len) {
+    msgbuf* m = msg_copy(buf, len);
+    bool ok = conn_send(c, m);
+    msg_put(m);
+    return ok;
+}
+
+// Called by the owning loop on EPOLLOUT
+void conn_flush(conn* c) {
+    pthread_mutex_lock(&c->out_lock);
+
+    outq_drain(c);
+    if (c->close_pending && c->out.empty())
+        shutdown(c->fd, SHUT_RDWR);
+
+    pthread_mutex_unlock(&c->out_lock);
+}
+
+// Thread safe close request, the socket is shut down once pending output is
+// written and the owning loop reaps it on the resulting EOF
+void conn_shutdown(conn* c) {
+    pthread_mutex_lock(&c->out_lock);
+    c->close_pending = true;
+    if (c->out.empty())
+        shutdown(c->fd, SHUT_RDWR);
+    pthread_mutex_unlock(&c->out_lock);
+}
+
+void* loop_run(void* _loop) {
+    event_loop* loop = (event_loop*) _loop;
+    struct epoll_event events[MAX_EVENTS];
+    int n;
+
+    CURRENT_LOOP = loop;
+    if (GLOBAL_BACKEND == BACKEND_URING) {
+        return uring_loop_run(loop);
+    }
+
+    while (true) {
+        if ((n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Failure on epoll_wait");
+            exit(1);
+        }
+        // * route each event to its conn, handlers may close their own conn
+        for (int i = 0; i < n; i++) {
+            conn* c = (conn*) events[i].data.ptr;
+            c->handler(c, events[i].events);
+        }
+        if (loop->woken) {
+            loop_run_posted(loop);
+        }
+    }
+    return 0;
+}
+
+#endif // REACTOR_H_
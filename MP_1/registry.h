@@ -0,0 +1,170 @@
+/*
+    Sharded room registry
+
+    Rooms are looked up by name in one of N_SHARDS shards picked by hash. Each
+    shard publishes an immutable snapshot (name -> room) that readers load
+    atomically, so JOIN and LIST never wait on a CREATE/DELETE in progress,
+    they just see the snapshot from before it. Writers copy the shard's map,
+    change the copy and swap it in under the shard's write_lock, so CREATE and
+    DELETE only contend with writers hashing to the same shard.
+
+    A snapshot holds a ref on every room in it, a room removed by DELETE stays
+    valid for readers still holding the old snapshot and is released with it.
+
+    GLOBAL_MAX_ROOMS is enforced across shards by an atomic count.
+*/
+#ifndef REGISTRY_H_
+#define REGISTRY_H_
+
+#include <pthread.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include "room.h"
+
+#define N_SHARDS (64)
+
+/* Globals */
+int GLOBAL_MAX_ROOMS = 10;      // -r
+
+// One immutable version of a shard
+struct room_map {
+    std::unordered_map<std::string, room*> rooms;
+
+    room_map() {}
+    room_map(const room_map& other) : rooms(other.rooms) {
+        for (auto& it : rooms) {
+            ++it.second->refs;
+        }
+    }
+    ~room_map() {
+        for (auto& it : rooms) {
+            room_put(it.second);
+        }
+    }
+};
+
+typedef std::shared_ptr<const room_map> room_snapshot;
+
+struct registry_shard {
+    pthread_mutex_t write_lock;
+    room_snapshot snap;
+};
+
+struct room_registry {
+    registry_shard shards[N_SHARDS];
+    std::atomic<int> n_rooms;
+
+    room_registry() {
+        n_rooms = 0;
+        for (int i = 0; i < N_SHARDS; i++) {
+            pthread_mutex_init(&shards[i].write_lock, NULL);
+            shards[i].snap = std::make_shared<const room_map>();
+        }
+    }
+
+    registry_shard& shard_of(const std::string& name) {
+        return shards[std::hash<std::string>()(name) % N_SHARDS];
+    }
+
+    room_snapshot load(registry_shard& s) {
+        return std::atomic_load(&s.snap);
+    }
+
+    // Room with a ref for the caller, nullptr if there is none
+    room* get(const std::string& name) {
+        room_snapshot snap = load(shard_of(name));
+        auto it = snap->rooms.find(name);
+        if (it == snap->rooms.end())
+            return nullptr;
+        ++it->second->refs;
+        return it->second;
+    }
+
+    /*
+     * Publish chatroom under its name, the registry takes its own ref
+     *
+     * @return  1 added,
+     *          0 the name is taken,
+     *         -1 GLOBAL_MAX_ROOMS reached
+     */
+    int insert(room* chatroom) {
+        registry_shard& s = shard_of(chatroom->name);
+        pthread_mutex_lock(&s.write_lock);
+
+        room_snapshot old = load(s);
+        if (old->rooms.count(chatroom->name)) {
+            pthread_mutex_unlock(&s.write_lock);
+            return 0;
+        }
+        if (n_rooms.fetch_add(1) >= GLOBAL_MAX_ROOMS) {
+            --n_rooms;
+            pthread_mutex_unlock(&s.write_lock);
+            return -1;
+        }
+
+        room_map* next = new room_map(*old);
+        ++chatroom->refs;
+        next->rooms[chatroom->name] = chatroom;
+        std::atomic_store(&s.snap, room_snapshot(next));
+
+        pthread_mutex_unlock(&s.write_lock);
+        return 1;
+    }
+
+    // Unpublish name, the room comes back with a ref for the caller
+    room* remove(const std::string& name) {
+        registry_shard& s = shard_of(name);
+        pthread_mutex_lock(&s.write_lock);
+
+        room_snapshot old = load(s);
+        auto it = old->rooms.find(name);
+        if (it == old->rooms.end()) {
+            pthread_mutex_unlock(&s.write_lock);
+            return nullptr;
+        }
+        room* chatroom = it->second;
+        ++chatroom->refs;
+
+        room_map* next = new room_map(*old);
+        next->rooms.erase(name);
+        room_put(chatroom);     // the copy's ref
+        std::atomic_store(&s.snap, room_snapshot(next));
+        --n_rooms;
+
+        pthread_mutex_unlock(&s.write_lock);
+        return chatroom;
+    }
+
+    // Every room, each with a ref for the caller
+    void rooms(std::vector<room*>* out) {
+        for (int i = 0; i < N_SHARDS; i++) {
+            room_snapshot snap = load(shards[i]);
+            for (auto& it : snap->rooms) {
+                ++it.second->refs;
+                out->push_back(it.second);
+            }
+        }
+    }
+
+    // "ROOM1, ROOM2, ...", capped so the LIST reply stays one frame
+    std::string names(size_t max_len) {
+        std::string list_str;
+        for (int i = 0; i < N_SHARDS; i++) {
+            room_snapshot snap = load(shards[i]);
+            for (auto& it : snap->rooms) {
+                size_t sep = list_str.empty() ? 0 : 2;
+                if (list_str.length() + sep + it.first.length() > max_len)
+                    return list_str;
+                if (sep)
+                    list_str += ", ";
+                list_str += it.first;
+            }
+        }
+        return list_str;
+    }
+};
+
+#endif // REGISTRY_H_
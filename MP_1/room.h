@@ -0,0 +1,137 @@
+/*
+    Chat room state shared by every loop
+
+    Members live on any loop, so a room is refcounted rather than freed by
+    DELETE: each registry snapshot holding it (registry.h), the room listener
+    and each member conn hold a ref, the last room_put frees it.
+
+    client_lock orders everything a member sees: broadcasts are queued and
+    recorded in history (history.h) under it, and a joiner gets its greeting
+    and the history replay queued under it too, so replay and live traffic
+    never overlap or leave a gap. Traffic counters (stats.h) need no lock.
+*/
+#ifndef ROOM_H_
+#define ROOM_H_
+
+#include <pthread.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "wire.h"
+#include "reactor.h"
+#include "history.h"
+#include "stats.h"
+
+/* Globals */
+int GLOBAL_MAX_MEMBERS = 20;    // -m, at most 255 since UIDs are one byte
+
+struct room {
+private:
+    u8 uid_counter;
+
+public:
+    int n_members;
+    int port;                   // 0 when multiplexed over the server port
+    u32 id;
+    std::string name;
+    conn* sock;                 // room listener
+    event_loop* loop;           // shard, every member's conn lives here
+    std::vector<conn*> members; // uid lives on the conn
+    pthread_mutex_t client_lock;
+    room_history history;
+    room_stats stats;
+
+    std::atomic<int> refs;
+    bool closing;               // set by DELETE, reject late joiners
+
+    room(std::string _name, int _port, u32 _id) {
+        name = _name;
+        port = _port;
+        id = _id;
+        sock = nullptr;
+        loop = nullptr;
+        n_members = 0;
+        uid_counter = 1;        // start at 1 so we don't shadow '\0'
+        refs = 1;
+        closing = false;
+        pthread_mutex_init(&client_lock, NULL);
+    }
+    ~room() {
+        pthread_mutex_destroy(&client_lock);
+    }
+
+    /*
+     * Add c and queue its greeting (if any) then the history replay
+     *
+     * @return  1 added,
+     *          0 the room was deleted under us,
+     *         -1 the room is full
+     */
+    int add_client(conn* c, msgbuf* greeting = nullptr) {
+        pthread_mutex_lock(&client_lock);
+        if (closing) {
+            pthread_mutex_unlock(&client_lock);
+            return 0;
+        }
+        if (n_members >= GLOBAL_MAX_MEMBERS) {
+            pthread_mutex_unlock(&client_lock);
+            return -1;
+        }
+        ++n_members;
+        members.push_back(c);
+        c->joined = true;
+
+        std::vector<msgbuf*> batch;
+        if (greeting) {
+            msg_get(greeting);
+            batch.push_back(greeting);
+        }
+        history.newest(std::min(GLOBAL_REPLAY_LEN, GLOBAL_OUTQ_LEN), &batch);
+        if (!batch.empty()) {
+            conn_send_batch(c, batch);
+        }
+        for (size_t i = 0; i < batch.size(); i++) {
+            msg_put(batch[i]);
+        }
+        pthread_mutex_unlock(&client_lock);
+        return 1;
+    }
+
+    void remove_client(conn* c) {
+        pthread_mutex_lock(&client_lock);
+        for (int i = 0; i < members.size(); i++) {
+            if (members[i] == c) {
+                members.erase(members.begin() + i);
+                --n_members;
+                break;
+            }
+        }
+        c->joined = false;
+        pthread_mutex_unlock(&client_lock);
+    }
+
+    bool full() {
+        pthread_mutex_lock(&client_lock);
+        bool is_full = n_members >= GLOBAL_MAX_MEMBERS;
+        pthread_mutex_unlock(&client_lock);
+        return is_full;
+    }
+
+    // JOINs for one room can arrive on any loop, UID 0 is the server's
+    char get_next_uid() {
+        pthread_mutex_lock(&client_lock);
+        if (uid_counter == 0)
+            ++uid_counter;
+        u8 uid = uid_counter++;
+        pthread_mutex_unlock(&client_lock);
+        return (char) uid;
+    }
+};
+
+void room_put(room* chatroom) {
+    if (--chatroom->refs == 0) {
+        delete chatroom;
+    }
+}
+
+#endif // ROOM_H_
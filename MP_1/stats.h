@@ -0,0 +1,184 @@
+/*
+    Per-room traffic counters, read by STATS
+
+    Every thread that handles a room's traffic bumps its own slot of the
+    room's counters, so the hot path is a relaxed add on a cache line no
+    other thread writes, no lock. STATS sums the slots when it's asked, the
+    totals can be a message or two apart from each other but never go back.
+    A room's slots (one per thread, ~256 B each) are only allocated with its
+    first message, an idle room costs a pointer.
+
+    Fan-out latency is the time from a MSG being parsed to it having been
+    written to, or queued on, every other member. Kept as a histogram of
+    power of two microsecond buckets: [0,1) [1,2) [2,4) ... the last one is
+    open ended.
+*/
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+
+#define STATS_SLOTS     (16)        // at most, threads beyond this share slots
+#define HIST_BUCKETS    (24)        // last bucket starts at ~4 s
+
+struct alignas(64) stats_slot {
+    std::atomic<uint64_t> msgs_in;
+    std::atomic<uint64_t> bytes_in;
+    std::atomic<uint64_t> msgs_out;     // member deliveries
+    std::atomic<uint64_t> bytes_out;
+    std::atomic<uint64_t> dropped;      // by the slow consumer policy
+    std::atomic<uint64_t> hist[HIST_BUCKETS];
+};
+
+// A consistent-enough copy of one room's counters
+struct stats_totals {
+    uint64_t msgs_in;
+    uint64_t bytes_in;
+    uint64_t msgs_out;
+    uint64_t bytes_out;
+    uint64_t dropped;
+    uint64_t hist[HIST_BUCKETS];
+};
+
+/* Globals */
+int GLOBAL_STATS_SLOTS = STATS_SLOTS;   // per room, set to the thread count
+std::atomic<int> GLOBAL_NEXT_STATS_SLOT(0);
+thread_local int STATS_SLOT = -1;
+
+int stats_slot_index() {
+    if (STATS_SLOT < 0)
+        STATS_SLOT = GLOBAL_NEXT_STATS_SLOT++ % GLOBAL_STATS_SLOTS;
+    return STATS_SLOT;
+}
+
+int hist_bucket(uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int b = 0;
+    while (us && b < HIST_BUCKETS - 1) {
+        us >>= 1;
+        ++b;
+    }
+    return b;
+}
+
+// "<X" microseconds, ">=X" for the open bucket
+std::string hist_label(int b) {
+    char label[32];
+    if (b < HIST_BUCKETS - 1) {
+        snprintf(label, sizeof(label), "<%llu", 1ull << b);
+    } else {
+        snprintf(label, sizeof(label), ">=%llu", 1ull << (b - 1));
+    }
+    return label;
+}
+
+void stat_add(std::atomic<uint64_t>& counter, uint64_t n) {
+    counter.fetch_add(n, std::memory_order_relaxed);
+}
+
+struct room_stats {
+    std::atomic<stats_slot*> slots;     // GLOBAL_STATS_SLOTS, null until traffic
+
+    room_stats() : slots(nullptr) { }
+    ~room_stats() { delete[] slots.load(); }
+
+    // One MSG of len bytes handed to n_out members, n_dropped queued frames
+    // lost to make room, fan-out took ns
+    void record(uint32_t len, uint64_t n_out, uint64_t n_dropped, uint64_t ns) {
+        stats_slot& s = slots_for_write()[stats_slot_index()];
+        stat_add(s.msgs_in, 1);
+        stat_add(s.bytes_in, len);
+        stat_add(s.msgs_out, n_out);
+        stat_add(s.bytes_out, n_out * len);
+        if (n_dropped)
+            stat_add(s.dropped, n_dropped);
+        stat_add(s.hist[hist_bucket(ns)], 1);
+    }
+
+    void sum(stats_totals* t) {
+        memset(t, 0, sizeof(*t));
+        stats_slot* all = slots.load(std::memory_order_acquire);
+        if (all == nullptr)
+            return;
+        for (int i = 0; i < GLOBAL_STATS_SLOTS; i++) {
+            stats_slot& s = all[i];
+            t->msgs_in += s.msgs_in.load(std::memory_order_relaxed);
+            t->bytes_in += s.bytes_in.load(std::memory_order_relaxed);
+            t->msgs_out += s.msgs_out.load(std::memory_order_relaxed);
+            t->bytes_out += s.bytes_out.load(std::memory_order_relaxed);
+            t->dropped += s.dropped.load(std::memory_order_relaxed);
+            for (int b = 0; b < HIST_BUCKETS; b++)
+                t->hist[b] += s.hist[b].load(std::memory_order_relaxed);
+        }
+    }
+
+  private:
+    // * the first message allocates them, zeroed. Two threads racing to
+    //   it both allocate, the loser frees its copy
+    stats_slot* slots_for_write() {
+        stats_slot* all = slots.load(std::memory_order_acquire);
+        if (all)
+            return all;
+        stats_slot* fresh = new stats_slot[GLOBAL_STATS_SLOTS]();
+        if (slots.compare_exchange_strong(all, fresh, std::memory_order_acq_rel))
+            return fresh;
+        delete[] fresh;
+        return all;
+    }
+};
+
+// Bucket holding quantile q, -1 while there are no samples
+int hist_quantile(const stats_totals& t, double q) {
+    uint64_t n = 0, seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++)
+        n += t.hist[b];
+    if (n == 0)
+        return -1;
+    uint64_t want = (uint64_t) (q * n);
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += t.hist[b];
+        if (seen > want)
+            return b;
+    }
+    return HIST_BUCKETS - 1;
+}
+
+/*
+ * Two lines of text for one room:
+ *     <name>: members N, msgs in/out A/B, bytes in/out C/D, dropped E
+ *       fan-out us: p50 <X p99 <Y p999 <Z | <1:n <2:n <4:n ...
+ * only non-empty buckets are listed, ">=X" is the open one, no percentiles
+ * until the room has seen a message
+ */
+std::string stats_format(const std::string& name, int n_members, const stats_totals& t) {
+    char line[256];
+    std::string out;
+
+    // * the name is client input of any length, keep it out of line
+    snprintf(line, sizeof(line),
+             ": members %d, msgs in/out %llu/%llu, bytes in/out %llu/%llu, dropped %llu\n",
+             n_members, (unsigned long long) t.msgs_in,
+             (unsigned long long) t.msgs_out, (unsigned long long) t.bytes_in,
+             (unsigned long long) t.bytes_out, (unsigned long long) t.dropped);
+    out += name + line;
+    out += "  fan-out us:";
+    if (hist_quantile(t, 0.5) >= 0) {
+        out += " p50 " + hist_label(hist_quantile(t, 0.5)) +
+               " p99 " + hist_label(hist_quantile(t, 0.99)) +
+               " p999 " + hist_label(hist_quantile(t, 0.999)) + " |";
+    }
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        if (t.hist[b] == 0)
+            continue;
+        snprintf(line, sizeof(line), " %s:%llu", hist_label(b).c_str(),
+                 (unsigned long long) t.hist[b]);
+        out += line;
+    }
+    return out + "\n";
+}
+
+#endif // STATS_H_
@@ -0,0 +1,125 @@
+/*
+    Hierarchical timer wheel
+
+    Each loop keeps one for its conns' idle deadlines. TIMER_LEVELS wheels of
+    TIMER_SLOTS lists each, a slot on level l spans 64^l ticks. Adding,
+    cancelling and re-adding a timer is a list splice whatever the number of
+    timers, a tick runs the one level 0 slot that's due and, every 64^l
+    ticks, spreads one level l slot over the level below. 100k idle conns
+    cost nothing until one of them is actually due.
+
+    Owned by one loop, nothing here is thread safe.
+*/
+#ifndef TIMER_H_
+#define TIMER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TIMER_BITS      (6)
+#define TIMER_SLOTS     (1 << TIMER_BITS)
+#define TIMER_MASK      (TIMER_SLOTS - 1)
+#define TIMER_LEVELS    (4)         // 64^4 ticks, ~19 days at 100 ms
+#define TIMER_TICK_MS   (100)
+
+typedef void (*timer_fn)(void* arg);
+
+struct timer {
+    timer* prev;
+    timer* next;                    // nullptr while not scheduled
+    uint64_t expires;               // tick
+    timer_fn fn;
+    void* arg;
+};
+
+struct timer_wheel {
+    uint64_t now;                   // ticks since the loop started
+    size_t n_timers;
+    timer slots[TIMER_LEVELS][TIMER_SLOTS];     // list heads
+};
+
+void timer_init(timer* t, timer_fn fn, void* arg) {
+    t->prev = nullptr;
+    t->next = nullptr;
+    t->expires = 0;
+    t->fn = fn;
+    t->arg = arg;
+}
+
+bool timer_pending(const timer* t) {
+    return t->next != nullptr;
+}
+
+void timer_wheel_init(timer_wheel* w) {
+    w->now = 0;
+    w->n_timers = 0;
+    for (int l = 0; l < TIMER_LEVELS; l++) {
+        for (int s = 0; s < TIMER_SLOTS; s++) {
+            w->slots[l][s].prev = &w->slots[l][s];
+            w->slots[l][s].next = &w->slots[l][s];
+        }
+    }
+}
+
+// Link t into the slot its expiry falls in, relative to now
+void timer_place(timer_wheel* w, timer* t) {
+    uint64_t delta = t->expires - w->now;
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 && delta >> (TIMER_BITS * (level + 1)))
+        ++level;
+    if (delta >> (TIMER_BITS * TIMER_LEVELS)) {
+        t->expires = w->now + (1ull << (TIMER_BITS * TIMER_LEVELS)) - 1;
+    }
+    timer* head = &w->slots[level][(t->expires >> (TIMER_BITS * level)) & TIMER_MASK];
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+void timer_del(timer_wheel* w, timer* t) {
+    if (!timer_pending(t))
+        return;
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = nullptr;
+    t->next = nullptr;
+    --w->n_timers;
+}
+
+// (Re)schedule t to fire ticks from now, at least one
+void timer_add(timer_wheel* w, timer* t, uint64_t ticks) {
+    timer_del(w, t);
+    t->expires = w->now + (ticks ? ticks : 1);
+    timer_place(w, t);
+    ++w->n_timers;
+}
+
+// Advance one tick and run whatever is due, callbacks may add or del timers
+void timer_tick(timer_wheel* w) {
+    ++w->now;
+
+    // * a level that just wrapped pulls the next slot of the one above down
+    for (int l = 1; l < TIMER_LEVELS; l++) {
+        if ((w->now >> (TIMER_BITS * (l - 1))) & TIMER_MASK)
+            break;
+        timer* head = &w->slots[l][(w->now >> (TIMER_BITS * l)) & TIMER_MASK];
+        timer* t = head->next;
+        head->prev = head;
+        head->next = head;
+        while (t != head) {
+            timer* next = t->next;
+            timer_place(w, t);
+            t = next;
+        }
+    }
+
+    timer* head = &w->slots[0][w->now & TIMER_MASK];
+    while (head->next != head) {
+        timer* t = head->next;
+        timer_del(w, t);
+        t->fn(t->arg);
+    }
+}
+
+#endif // TIMER_H_
@@ -0,0 +1,136 @@
+/*
+    Minimal io_uring ring, raw syscalls, no liburing
+
+    Just what the reactor's uring backend needs: set up and map a ring, hand
+    out SQEs, submit and wait in one io_uring_enter, walk the CQEs. A ring is
+    owned by one loop thread, nothing here is thread safe.
+*/
+#ifndef URING_H_
+#define URING_H_
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+
+struct uring {
+    int fd;
+
+    // Submission queue
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned sq_local_tail;     // SQEs handed out, not yet published
+    unsigned to_submit;
+
+    // Completion queue
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_map;
+    size_t sq_map_len;
+    size_t sqes_len;
+};
+
+int sys_io_uring_setup(unsigned entries, struct io_uring_params* p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// Return false (errno set) if the kernel won't give us a ring
+bool uring_init(uring* r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    if ((r->fd = sys_io_uring_setup(entries, &p)) < 0)
+        return false;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(r->fd);
+        errno = ENOSYS;
+        return false;
+    }
+
+    // * SQ and CQ rings share one mapping, the SQE array is its own
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sq_map_len = sq_len > cq_len ? sq_len : cq_len;
+    r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = (struct io_uring_sqe*) mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sq_map == MAP_FAILED || r->sqes == MAP_FAILED) {
+        close(r->fd);
+        return false;
+    }
+
+    char* base = (char*) r->sq_map;
+    r->sq_head = (unsigned*) (base + p.sq_off.head);
+    r->sq_tail = (unsigned*) (base + p.sq_off.tail);
+    r->sq_mask = *(unsigned*) (base + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_array = (unsigned*) (base + p.sq_off.array);
+    r->sq_local_tail = *r->sq_tail;
+    r->to_submit = 0;
+
+    r->cq_head = (unsigned*) (base + p.cq_off.head);
+    r->cq_tail = (unsigned*) (base + p.cq_off.tail);
+    r->cq_mask = *(unsigned*) (base + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*) (base + p.cq_off.cqes);
+    return true;
+}
+
+// Publish queued SQEs and optionally wait for wait_nr completions
+int uring_enter(uring* r, unsigned wait_nr) {
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    int n;
+    while ((n = sys_io_uring_enter(r->fd, r->to_submit, wait_nr, flags)) < 0 && errno == EINTR)
+        ;
+    if (n > 0)
+        r->to_submit -= (unsigned) n < r->to_submit ? n : r->to_submit;
+    return n;
+}
+
+// Zeroed SQE, submits what's queued first if the SQ is full
+struct io_uring_sqe* uring_sqe(uring* r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sq_local_tail - head >= r->sq_entries) {
+        uring_enter(r, 0);
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (r->sq_local_tail - head >= r->sq_entries)
+            return nullptr;
+    }
+    unsigned idx = r->sq_local_tail & r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    ++r->sq_local_tail;
+    ++r->to_submit;
+    return sqe;
+}
+
+// Next completion or nullptr, uring_cqe_seen(...) once it's handled
+struct io_uring_cqe* uring_peek_cqe(uring* r) {
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return nullptr;
+    return &r->cqes[head & r->cq_mask];
+}
+
+void uring_cqe_seen(uring* r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif // URING_H_
@@ -0,0 +1,189 @@
+/*
+    crsd/crc wire protocol
+
+    Everything on a connection, commands, replies and chat, is a frame:
+
+        {1B TYPE||1B UID||4B ROOM_ID||4B TAG||4B LEN||LEN B PAYLOAD}
+
+    integers are network byte-order, the payload is raw bytes and is NOT
+    nullterminated. Readers must handle a frame arriving over several reads,
+    or several frames arriving in one.
+
+    TAG is a request id picked by the client on commands and echoed on the
+    matching reply, so a client can have several commands in flight on one
+    connection. On chat frames from the server it is the room's sequence
+    number, see below. It is 0 on every other frame.
+
+    Commands (client -> server), payload = room name, empty for LIST
+    Replies  (server -> client), payload = {1B STATUS||...}
+        CREATE, DELETE  {1B STATUS}
+        JOIN            {1B STATUS||1B UID||4B N_MEMBERS||4B PORT}, the frame's
+                        ROOM_ID is the joined room, PORT=0 means the room is
+                        multiplexed over this connection
+        LIST            {1B STATUS||ROOM1, ROOM2, ...}
+        STATS           {1B STATUS||TEXT}, counters for the named room or
+                        every room if the name is empty (stats.h)
+    Chat
+        HELLO   client -> per-port room socket, first frame, carries UID
+        MSG     chat message, ROOM_ID must be the joined room. The room
+                stamps TAG with its next sequence number (from 1, never
+                reused by the room, kept across restarts with -L) before
+                forwarding it
+        ACK     server -> the MSG's sender, empty, TAG = the sequence number
+                the MSG got. With these a member sees every number once, in
+                order, so a jump means frames were lost (slow consumer
+                policy, a reconnect)
+        RESEND  client -> server {4B FIRST||4B LAST}, resend the MSGs numbered
+                FIRST..LAST that the room still keeps (history.h), they come
+                with their original TAGs, then a NOTICE if any are gone
+        NOTICE  server -> members, e.g. the room is being deleted
+    Keepalive, on any connection
+        PING    server -> client after a quiet spell, empty
+        PONG    client -> server answer, empty. Any frame counts as a sign of
+                life, a client that stays silent through a PING is dropped
+*/
+#ifndef WIRE_H_
+#define WIRE_H_
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+/* Types */
+typedef uint8_t u8;
+typedef uint32_t u32;
+
+/* Frame types */
+#define CREATE  ('\x01')
+#define DELETE  ('\x02')
+#define JOIN    ('\x03')
+#define LIST    ('\x04')
+#define STATS   ('\x05')
+#define REPLY   ('\x10')
+#define HELLO   ('\x11')
+#define MSG     ('\x12')
+#define NOTICE  ('\x13')
+#define PING    ('\x14')
+#define PONG    ('\x15')
+#define RESEND  ('\x16')
+#define ACK     ('\x17')
+
+#define HDR_LEN     (14)
+#define MAX_PAYLOAD (64 * 1024)     // larger frames are a protocol error
+
+struct frame_hdr {
+    u8 type;
+    u8 uid;
+    u32 room_id;
+    u32 tag;
+    u32 len;
+};
+
+void pack_hdr(char* buf, u8 type, u8 uid, u32 room_id, u32 len, u32 tag = 0) {
+    buf[0] = (char) type;
+    buf[1] = (char) uid;
+    room_id = htonl(room_id);
+    tag = htonl(tag);
+    len = htonl(len);
+    memcpy(buf + 2, &room_id, 4);
+    memcpy(buf + 6, &tag, 4);
+    memcpy(buf + 10, &len, 4);
+}
+
+// Overwrite TAG of the packed frame at buf
+void set_tag(char* buf, u32 tag) {
+    tag = htonl(tag);
+    memcpy(buf + 6, &tag, 4);
+}
+
+void unpack_hdr(const char* buf, frame_hdr* hdr) {
+    hdr->type = (u8) buf[0];
+    hdr->uid = (u8) buf[1];
+    memcpy(&hdr->room_id, buf + 2, 4);
+    memcpy(&hdr->tag, buf + 6, 4);
+    memcpy(&hdr->len, buf + 10, 4);
+    hdr->room_id = ntohl(hdr->room_id);
+    hdr->tag = ntohl(hdr->tag);
+    hdr->len = ntohl(hdr->len);
+}
+
+std::string make_frame(u8 type, u8 uid, u32 room_id, const char* payload, u32 len,
+                       u32 tag = 0) {
+    std::string frame(HDR_LEN + len, '\0');
+    pack_hdr(&frame[0], type, uid, room_id, len, tag);
+    if (len)
+        memcpy(&frame[HDR_LEN], payload, len);
+    return frame;
+}
+
+std::string make_frame(u8 type, u8 uid, u32 room_id, const std::string& payload,
+                       u32 tag = 0) {
+    return make_frame(type, uid, room_id, payload.data(), payload.length(), tag);
+}
+
+/*
+ * Check for a complete frame at buf[0..avail)
+ *
+ * @return  1 if a whole frame is there (hdr filled),
+ *          0 if more bytes are needed,
+ *         -1 if the header is garbage and the peer should be dropped
+ */
+int peek_frame(const char* buf, size_t avail, frame_hdr* hdr) {
+    if (avail < HDR_LEN)
+        return 0;
+    unpack_hdr(buf, hdr);
+    if (hdr->len > MAX_PAYLOAD)
+        return -1;
+    return avail >= HDR_LEN + hdr->len ? 1 : 0;
+}
+
+/* Blocking helpers for the client side, loop over partial reads/writes */
+
+bool send_all(int sock, const char* buf, size_t len) {
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t n = send(sock, buf + sent, len - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        sent += n;
+    }
+    return true;
+}
+
+bool recv_all(int sock, char* buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = recv(sock, buf + got, len - got, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        got += n;
+    }
+    return true;
+}
+
+bool send_frame(int sock, u8 type, u8 uid, u32 room_id, const char* payload, u32 len,
+                u32 tag = 0) {
+    std::string frame = make_frame(type, uid, room_id, payload, len, tag);
+    return send_all(sock, frame.data(), frame.length());
+}
+
+// Read one whole frame, false on EOF/error or an oversized frame
+bool recv_frame(int sock, frame_hdr* hdr, std::string* payload) {
+    char buf[HDR_LEN];
+    if (!recv_all(sock, buf, HDR_LEN))
+        return false;
+    unpack_hdr(buf, hdr);
+    if (hdr->len > MAX_PAYLOAD)
+        return false;
+    payload->resize(hdr->len);
+    return hdr->len == 0 || recv_all(sock, &(*payload)[0], hdr->len);
+}
+
+#endif // WIRE_H_
@@ -0,0 +1,80 @@
+/*
+    Small helpers for tsd's on-disk formats (store.h, posts.h): integers go
+    in network byte-order, files are read whole or written in full
+*/
+#ifndef FILES_H_
+#define FILES_H_
+
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+
+/* Globals */
+std::string GLOBAL_STORE_DIR = ".";     // -d
+
+void put_u32(std::string* out, uint32_t v) {
+    v = htonl(v);
+    out->append((const char*) &v, 4);
+}
+
+uint32_t get_u32(const char* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return ntohl(v);
+}
+
+void put_u64(std::string* out, uint64_t v) {
+    put_u32(out, v >> 32);
+    put_u32(out, v);
+}
+
+uint64_t get_u64(const char* p) {
+    return (uint64_t) get_u32(p) << 32 | get_u32(p + 4);
+}
+
+// Whole file into out, false if it can't be read
+bool read_file(const std::string& path, std::string* out) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return false;
+    }
+    out->resize(st.st_size);
+    size_t got = 0;
+    while (got < out->size()) {
+        ssize_t n = read(fd, &(*out)[got], out->size() - got);
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+    }
+    close(fd);
+    out->resize(got);
+    return true;
+}
+
+bool write_all(int fd, const std::string& buf) {
+    size_t off = 0;
+    while (off < buf.size()) {
+        ssize_t n = write(fd, buf.data() + off, buf.size() - off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        off += n;
+    }
+    return true;
+}
+
+#endif // FILES_H_
@@ -0,0 +1,339 @@
+/*
+    Post history: a log per author, a timeline index per follower
+
+    Every post is appended to its author's log before it's fanned out, in
+    segments of up to POST_SEGMENT_BYTES under GLOBAL_STORE_DIR/posts:
+
+        posts/<author id>.<segment>     {4B LEN||8B AT||serialized Message}...
+
+    AT is when the post reached the server (ns since the epoch), timelines
+    are ordered by it since clients don't reliably stamp their posts.
+
+    Each author knows where its last TIMELINE_LEN posts are (the tail). One
+    that has posted since startup also holds them in memory, the same Post
+    objects the fan-out queued, so a hot author's recent posts are never
+    read back from disk. A cold one's cost a reference each.
+
+    Each follower that has entered TIMELINE keeps a materialized index of
+    the last TIMELINE_LEN posts fanned out to it, as references: where the
+    post lives on disk and a weak pointer to it in memory. Entering TIMELINE
+    replays that index, a post still held by its author's tail (or anyone's
+    queue) comes from memory, an older one is read from its author's mmap'd
+    segment.
+
+    After a restart an index is rebuilt the first time it's needed by
+    merging the tails of everyone the user follows, which are loaded from
+    the end of their logs. A torn record at the end of a log is skipped and
+    the author carries on in a new segment.
+
+    An author's current segment stays open between posts, so a post costs
+    one write. Only the POST_OPEN_SEGMENTS most recently used stay open,
+    an idle author's is closed and reopened on its next post. Posts are
+    written but not synced: they survive tsd crashing, not the machine
+    going down (unlike the follow graph, store.h).
+*/
+#ifndef POSTS_H_
+#define POSTS_H_
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include "files.h"
+#include "sns.grpc.pb.h"
+
+#define TIMELINE_LEN        (20)            // posts replayed on entering TIMELINE
+#define POST_SEGMENT_BYTES  (1 << 20)
+#define POST_OPEN_SEGMENTS  (256)           // fds kept open over all authors
+
+// A post is built once and shared by every follower's queue
+typedef std::shared_ptr<const csce438::Message> Post;
+
+// PostRef::seg of a post that never made it to disk
+const uint32_t NO_SEGMENT = 0xffffffff;
+
+/* Globals */
+std::atomic<uint64_t> GLOBAL_REPLAYED(0);       // posts replayed from memory
+std::atomic<uint64_t> GLOBAL_COLD_READS(0);     // and from disk
+
+// Where a post lives, and the post itself while something still holds it
+struct PostRef {
+    uint32_t author;
+    uint32_t seg;
+    uint32_t off;                   // of its record in the segment
+    uint64_t at;
+    std::weak_ptr<const csce438::Message> hot;
+};
+
+std::string post_path(uint32_t author, uint32_t seg) {
+    return GLOBAL_STORE_DIR + "/posts/" + std::to_string(author) + "." + std::to_string(seg);
+}
+
+// An open segment, closed once nothing uses it
+struct OpenSegment {
+    int fd;
+    bool listed;                    // in SegmentFds' list, under its lock
+    std::list<std::shared_ptr<OpenSegment> >::iterator pos;
+
+    explicit OpenSegment(int f) : fd(f), listed(false) { }
+    ~OpenSegment() { close(fd); }
+};
+
+// The POST_OPEN_SEGMENTS most recently written segments. Dropping one from
+// the list only closes it once the write that may be using it is done
+class SegmentFds {
+  public:
+    // Return nullptr: if f isn't open any more. Marks it most recently used
+    std::shared_ptr<OpenSegment> use(const std::weak_ptr<OpenSegment>& f) {
+        std::shared_ptr<OpenSegment> s = f.lock();
+        std::lock_guard<std::mutex> l(lock);
+        if (!s || !s->listed) {
+            return nullptr;
+        }
+        lru.splice(lru.begin(), lru, s->pos);
+        return s;
+    }
+    void add(const std::shared_ptr<OpenSegment>& s) {
+        std::vector<std::shared_ptr<OpenSegment> > closing;
+        std::lock_guard<std::mutex> l(lock);
+        lru.push_front(s);
+        s->listed = true;
+        s->pos = lru.begin();
+        while (lru.size() > POST_OPEN_SEGMENTS) {
+            lru.back()->listed = false;
+            closing.push_back(lru.back());
+            lru.pop_back();
+        }
+    }
+    void drop(const std::shared_ptr<OpenSegment>& s) {
+        std::lock_guard<std::mutex> l(lock);
+        if (s->listed) {
+            s->listed = false;
+            lru.erase(s->pos);
+        }
+    }
+
+  private:
+    std::mutex lock;                // guards the list and every listed flag
+    std::list<std::shared_ptr<OpenSegment> > lru;   // most recent first
+};
+
+SegmentFds GLOBAL_SEGMENT_FDS;
+
+// Create the posts directory if it's not there yet
+bool open_post_store() {
+    std::string dir = GLOBAL_STORE_DIR + "/posts";
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        perror("Failure on posts directory");
+        return false;
+    }
+    return true;
+}
+
+// Reads posts out of their segments, keeping the last one mapped since a
+// replay tends to hit the same author's segment over and over
+class ColdReader {
+  public:
+    ColdReader() : author(0), seg(0), base(nullptr), len(0) { }
+    ~ColdReader() { unmap(); }
+
+    // Return nullptr: if the post can't be read back
+    Post read(const PostRef& ref) {
+        if (ref.seg == NO_SEGMENT) {
+            return nullptr;
+        }
+        if (base == nullptr || ref.author != author || ref.seg != seg) {
+            unmap();
+            map(ref.author, ref.seg);
+        }
+        if (base == nullptr || (size_t) ref.off + 12 > len ||
+            (size_t) ref.off + 12 + get_u32(base + ref.off) > len) {
+            return nullptr;
+        }
+        std::shared_ptr<csce438::Message> m = std::make_shared<csce438::Message>();
+        if (!m->ParseFromArray(base + ref.off + 12, get_u32(base + ref.off))) {
+            return nullptr;
+        }
+        ++GLOBAL_COLD_READS;
+        return m;
+    }
+
+  private:
+    void map(uint32_t a, uint32_t s) {
+        author = a;
+        seg = s;
+        int fd = open(post_path(a, s).c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                base = (const char*) p;
+                len = st.st_size;
+            }
+        }
+        close(fd);
+    }
+    void unmap() {
+        if (base) {
+            munmap((void*) base, len);
+        }
+        base = nullptr;
+        len = 0;
+    }
+
+    uint32_t author;
+    uint32_t seg;
+    const char* base;
+    size_t len;
+};
+
+// One author's posts. Appends come from whichever thread read the post,
+// the lock keeps the log and the tail in order
+struct PostLog {
+    std::mutex lock;                // guards the rest
+    bool loaded;                    // tail and segment found on disk
+    uint32_t seg;                   // being appended to
+    uint32_t seg_bytes;
+    // newest at the back. The post is null for one read back from disk,
+    // only what's been posted since startup is held in memory
+    std::deque<std::pair<PostRef, Post> > tail;
+    uint64_t last_at;
+    std::weak_ptr<OpenSegment> out; // seg, while it's open
+
+    PostLog() : loaded(false), seg(0), seg_bytes(0), last_at(0) { }
+
+    // Write p to the log, keep it in the tail and return where it went. A
+    // failed write is reported and the post still goes out, it just can't
+    // be read back once it's out of memory
+    PostRef append(uint32_t author, const Post& p) {
+        std::lock_guard<std::mutex> l(lock);
+        load(author);
+        // * AT goes up per author even if the clock steps back
+        uint64_t at = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        at = std::max(at, last_at + 1);
+        last_at = at;
+        std::string msg, rec;
+        p->SerializeToString(&msg);
+        put_u32(&rec, msg.size());
+        put_u64(&rec, at);
+        rec += msg;
+        std::shared_ptr<OpenSegment> f = GLOBAL_SEGMENT_FDS.use(out);
+        if (seg_bytes > 0 && seg_bytes + rec.size() > POST_SEGMENT_BYTES) {
+            ++seg;
+            seg_bytes = 0;
+            if (f) {
+                GLOBAL_SEGMENT_FDS.drop(f);
+                f.reset();
+            }
+        }
+        if (!f) {
+            int fd = open(post_path(author, seg).c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+            if (fd >= 0) {
+                f = std::make_shared<OpenSegment>(fd);
+                GLOBAL_SEGMENT_FDS.add(f);
+                out = f;
+            }
+        }
+        PostRef ref = {author, seg, seg_bytes, at, p};
+        if (f == nullptr) {
+            // * nothing written, the next post takes its place
+            perror("Failure on post open");
+            ref.seg = NO_SEGMENT;
+        } else if (write_all(f->fd, rec)) {
+            seg_bytes += rec.size();
+        } else {
+            // * what did make it is a torn record, carry on in a new
+            //   segment as load() would. ref points at the tear, so a cold
+            //   read of it fails rather than finding another post
+            perror("Failure on post write");
+            ++seg;
+            seg_bytes = 0;
+            GLOBAL_SEGMENT_FDS.drop(f);
+        }
+        keep(ref, p);
+        return ref;
+    }
+
+    // The tail, oldest first
+    std::vector<PostRef> recent(uint32_t author) {
+        std::lock_guard<std::mutex> l(lock);
+        load(author);
+        std::vector<PostRef> out;
+        for (size_t i = 0; i < tail.size(); i++) {
+            out.push_back(tail[i].first);
+        }
+        return out;
+    }
+
+  private:
+    void keep(const PostRef& ref, const Post& p) {
+        tail.push_back(std::make_pair(ref, p));
+        if (tail.size() > TIMELINE_LEN) {
+            tail.pop_front();
+        }
+    }
+
+    // lock held. Find the last segment and read the tail out of the end of
+    // the log, once
+    void load(uint32_t author) {
+        if (loaded) {
+            return;
+        }
+        loaded = true;
+        uint32_t n_segs = 0;
+        while (access(post_path(author, n_segs).c_str(), F_OK) == 0) {
+            ++n_segs;
+        }
+        if (n_segs == 0) {
+            return;
+        }
+        // * walk back until enough posts are found, then keep them in order
+        std::vector<std::vector<std::pair<PostRef, Post> > > found;
+        size_t n_found = 0;
+        for (uint32_t s = n_segs; s-- > 0 && n_found < TIMELINE_LEN; ) {
+            std::string buf;
+            read_file(post_path(author, s), &buf);
+            std::vector<std::pair<PostRef, Post> > posts;
+            size_t off = 0;
+            csce438::Message m;
+            while (off + 12 <= buf.size() && off + 12 + get_u32(&buf[off]) <= buf.size()) {
+                uint32_t len = get_u32(&buf[off]);
+                if (!m.ParseFromArray(&buf[off + 12], len)) {
+                    break;
+                }
+                PostRef ref = {author, s, (uint32_t) off, get_u64(&buf[off + 4]), Post()};
+                posts.push_back(std::make_pair(ref, Post()));
+                last_at = std::max(last_at, ref.at);
+                off += 12 + len;
+            }
+            if (s == n_segs - 1) {
+                // * never append behind a torn record
+                seg = off == buf.size() ? s : s + 1;
+                seg_bytes = off == buf.size() ? off : 0;
+            }
+            n_found += posts.size();
+            found.push_back(posts);
+        }
+        for (size_t i = found.size(); i-- > 0; ) {
+            for (size_t j = 0; j < found[i].size(); j++) {
+                keep(found[i][j].first, found[i][j].second);
+            }
+        }
+    }
+};
+
+#endif // POSTS_H_
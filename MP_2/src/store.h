@@ -0,0 +1,388 @@
+/*
+    Follow graph persistence: write-ahead log + snapshots
+
+    Every change to the user table (a new user, a follow, an unfollow) is
+    appended to the log as a small binary record while the locks it was
+    made under are held (the stripes of both users, or the table's id lock),
+    so changes to the same users are logged in the order they were applied:
+
+        LOGIN       {1B 'L'||4B ID||4B LEN||NAME}
+        FOLLOW      {1B 'F'||4B FOLLOWER ID||4B FOLLOWED ID}
+        UNFOLLOW    {1B 'U'||4B FOLLOWER ID||4B FOLLOWED ID}
+
+    integers in network byte-order. Records only go to a buffer, the log
+    thread writes out whatever has piled up with one write and one
+    fdatasync (group commit) and then lets the calls waiting on them reply,
+    so a follow costs ~9 bytes on disk and concurrent changes share a sync.
+
+    Every GLOBAL_SNAPSHOT_SECS, if anything was logged, the log thread
+    switches to a new log segment with only new logins held off, then
+    copies the table out one stripe at a time while calls carry on. The
+    copy can have changes from the new segment in it, which is fine since
+    replaying a record twice leaves the same graph. It's written as a
+    compact snapshot (tmp file + rename) and the segments it covers are
+    removed:
+
+        {8B "TSDSNAP1"||4B NEXT SEGMENT||4B N_USERS
+         ||N_USERS x {4B LEN||NAME}||N_USERS x {4B N||N x 4B FOLLOWER ID}}
+
+    Startup loads the snapshot, removes any segments before NEXT SEGMENT
+    left by a crash, and replays the segments from NEXT SEGMENT on, a torn
+    record at the end of one is ignored. Files live in
+    GLOBAL_STORE_DIR (files.h) as tsd.snap and tsd.wal.<segment>.
+*/
+#ifndef STORE_H_
+#define STORE_H_
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "files.h"
+#include "tsd.h"
+
+/* Globals */
+int GLOBAL_SNAPSHOT_SECS = 60;          // -S
+
+// Set by GraphLog::log_* for the call being handled on this thread, the
+// log position its reply has to wait for. 0 if it changed nothing
+thread_local uint64_t PENDING_LSN = 0;
+
+class GraphLog {
+  public:
+    GraphLog() : users(nullptr), fd(-1), segment(0), first_segment(0),
+                 appended(0), durable(0), snapshotted(0) { }
+
+    /*
+     * Load the snapshot and replay the log into an empty table, then open a
+     * fresh segment and start the log thread
+     *
+     * @return false if the store can't be read or written
+     */
+    bool open(UserTable* t) {
+        users = t;
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::string buf;
+        if (read_file(snap_path(), &buf) && !load_snapshot(buf)) {
+            std::cerr << "Bad snapshot " << snap_path() << "\n";
+            return false;
+        }
+        // * a crash between the rename and the unlinks leaves covered segments
+        uint32_t stale = segment;
+        while (stale > 0 && unlink(wal_path(stale - 1).c_str()) == 0) {
+            --stale;
+        }
+        first_segment = segment;
+        size_t n_records = 0;
+        while (read_file(wal_path(segment), &buf)) {
+            n_records += replay(buf);
+            ++segment;
+        }
+        size_t n_edges = 0;
+        for (size_t i = 0; i < users->size(); i++) {
+            n_edges += users->get(i)->followers.size() - 1;
+        }
+        long ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        std::cerr << "Loaded " << users->size() << " users, " << n_edges << " follows ("
+                  << n_records << " log records) in " << ms << " ms\n";
+
+        // * never append to a segment that may end in a torn record
+        fd = open_segment(segment);
+        if (fd < 0) {
+            return false;
+        }
+        std::thread(&GraphLog::run, this).detach();
+        return true;
+    }
+
+    /* Changes, caller holds the locks the change was made under */
+
+    void log_login(uint32_t id, const std::string& name) {
+        std::string rec(1, 'L');
+        put_u32(&rec, id);
+        put_u32(&rec, name.size());
+        rec += name;
+        append(rec);
+    }
+    void log_follow(uint32_t follower, uint32_t followed) {
+        std::string rec(1, 'F');
+        put_u32(&rec, follower);
+        put_u32(&rec, followed);
+        append(rec);
+    }
+    void log_unfollow(uint32_t follower, uint32_t followed) {
+        std::string rec(1, 'U');
+        put_u32(&rec, follower);
+        put_u32(&rec, followed);
+        append(rec);
+    }
+
+    // Run fn once everything up to lsn is on disk, right away if it is
+    void when_durable(uint64_t lsn, std::function<void()> fn) {
+        std::unique_lock<std::mutex> l(lock);
+        if (lsn > durable) {
+            waiters.push_back(Waiter(lsn, fn));
+            return;
+        }
+        l.unlock();
+        fn();
+    }
+
+  private:
+    typedef std::pair<uint64_t, std::function<void()> > Waiter;
+
+    void append(const std::string& rec) {
+        std::lock_guard<std::mutex> l(lock);
+        buf += rec;
+        PENDING_LSN = ++appended;
+        wake.notify_one();
+    }
+
+    std::string snap_path() { return GLOBAL_STORE_DIR + "/tsd.snap"; }
+    std::string wal_path(uint32_t seg) {
+        return GLOBAL_STORE_DIR + "/tsd.wal." + std::to_string(seg);
+    }
+
+    // Return -1: if the segment can't be created
+    int open_segment(uint32_t seg) {
+        int sfd = ::open(wal_path(seg).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (sfd < 0) {
+            perror("Failure on log open");
+        }
+        return sfd;
+    }
+
+    // The log thread: group commit, and a snapshot now and then
+    void run() {
+        std::chrono::steady_clock::time_point next_snap = std::chrono::steady_clock::now() +
+            std::chrono::seconds(GLOBAL_SNAPSHOT_SECS);
+        while (true) {
+            {
+                std::unique_lock<std::mutex> l(lock);
+                if (GLOBAL_SNAPSHOT_SECS > 0) {
+                    wake.wait_until(l, next_snap, [this] { return !buf.empty(); });
+                } else {
+                    wake.wait(l, [this] { return !buf.empty(); });
+                }
+            }
+            flush();
+            if (GLOBAL_SNAPSHOT_SECS > 0 && std::chrono::steady_clock::now() >= next_snap) {
+                snapshot();
+                next_snap = std::chrono::steady_clock::now() +
+                    std::chrono::seconds(GLOBAL_SNAPSHOT_SECS);
+            }
+        }
+    }
+
+    // Write and sync what's buffered, then release the calls waiting on it.
+    // Log thread only, it's the only one touching fd
+    void flush() {
+        std::unique_lock<std::mutex> l(lock);
+        if (buf.empty()) {
+            return;
+        }
+        std::string out;
+        out.swap(buf);
+        uint64_t upto = appended;
+        l.unlock();
+        write_out(fd, out, upto);
+    }
+
+    void write_out(int to, const std::string& out, uint64_t upto) {
+        if (!write_all(to, out) || fdatasync(to) < 0) {
+            perror("Failure on log write");
+        }
+
+        std::vector<Waiter> ready;
+        std::unique_lock<std::mutex> l(lock);
+        durable = upto;
+        for (size_t i = 0; i < waiters.size(); ) {
+            if (waiters[i].first <= upto) {
+                ready.push_back(waiters[i]);
+                waiters[i] = waiters.back();
+                waiters.pop_back();
+            } else {
+                i++;
+            }
+        }
+        l.unlock();
+        for (size_t i = 0; i < ready.size(); i++) {
+            ready[i].second();
+        }
+    }
+
+    void snapshot() {
+        {
+            std::lock_guard<std::mutex> l(lock);
+            if (appended == snapshotted) {
+                return;
+            }
+        }
+        int next_fd = open_segment(segment + 1);
+        if (next_fd < 0) {
+            exit(1);
+        }
+
+        // * switch segments with no login in flight, so the old segment
+        //   logs exactly the first n users. Nothing else waits on this
+        users->lock_ids();
+        std::unique_lock<std::mutex> l(lock);
+        std::string out;
+        out.swap(buf);
+        uint64_t upto = appended;
+        snapshotted = appended;
+        int old_fd = fd;
+        fd = next_fd;
+        ++segment;
+        l.unlock();
+        uint32_t n = users->size();
+        users->unlock_ids();
+
+        write_out(old_fd, out, upto);
+        close(old_fd);
+
+        // * copy a stripe at a time. A follower past n followed after the
+        //   switch, the new segment has it
+        std::vector<std::vector<uint32_t> > followers(n);
+        for (uint32_t s = 0; s < USER_STRIPES; s++) {
+            users->stripe(s).lock_shared();
+            for (uint32_t i = s; i < n; i += USER_STRIPES) {
+                users->get(i)->followers.for_each([&](uint32_t id) {
+                    if (id < n) {
+                        followers[i].push_back(id);
+                    }
+                });
+            }
+            users->stripe(s).unlock_shared();
+        }
+        std::string snap("TSDSNAP1");
+        put_u32(&snap, segment);
+        put_u32(&snap, n);
+        for (uint32_t i = 0; i < n; i++) {
+            const std::string& name = users->name_of(i);
+            put_u32(&snap, name.size());
+            snap += name;
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            put_u32(&snap, followers[i].size());
+            for (size_t j = 0; j < followers[i].size(); j++) {
+                put_u32(&snap, followers[i][j]);
+            }
+        }
+        std::vector<std::vector<uint32_t> >().swap(followers);
+
+        // * the old segments only go once the snapshot is safely in place
+        std::string tmp = snap_path() + ".tmp";
+        int sfd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        bool ok = sfd >= 0 && write_all(sfd, snap) && fsync(sfd) == 0;
+        if (sfd >= 0) {
+            close(sfd);
+        }
+        if (!ok || rename(tmp.c_str(), snap_path().c_str()) < 0) {
+            perror("Failure on snapshot");
+            return;
+        }
+        for (; first_segment < segment; first_segment++) {
+            unlink(wal_path(first_segment).c_str());
+        }
+    }
+
+    bool load_snapshot(const std::string& s) {
+        if (s.size() < 16 || s.compare(0, 8, "TSDSNAP1") != 0) {
+            return false;
+        }
+        size_t off = 8;
+        segment = get_u32(s.data() + off);
+        uint32_t n_users = get_u32(s.data() + off + 4);
+        off += 8;
+        for (uint32_t i = 0; i < n_users; i++) {
+            if (off + 4 > s.size() || off + 4 + get_u32(s.data() + off) > s.size()) {
+                return false;
+            }
+            uint32_t len = get_u32(s.data() + off);
+            users->add(s.substr(off + 4, len));
+            off += 4 + len;
+        }
+        // * following mirrors followers, rebuild it as we go
+        for (uint32_t i = 0; i < n_users; i++) {
+            if (off + 4 > s.size()) {
+                return false;
+            }
+            uint32_t n = get_u32(s.data() + off);
+            off += 4;
+            if (off + (size_t) n * 4 > s.size()) {
+                return false;
+            }
+            User* u = users->get(i);
+            u->followers.reserve(n);
+            for (uint32_t j = 0; j < n; j++, off += 4) {
+                uint32_t id = get_u32(s.data() + off);
+                if (id >= n_users) {
+                    return false;
+                }
+                u->followers.insert(id);
+                users->get(id)->following.insert(i);
+            }
+        }
+        return true;
+    }
+
+    // Apply every whole record in s, return how many
+    size_t replay(const std::string& s) {
+        size_t off = 0, n = 0;
+        while (off + 9 <= s.size()) {
+            char op = s[off];
+            uint32_t a = get_u32(s.data() + off + 1);
+            uint32_t b = get_u32(s.data() + off + 5);
+            if (op == 'L') {
+                if (off + 9 + b > s.size()) {
+                    break;
+                }
+                bool added;
+                User* u = users->add(s.substr(off + 9, b), &added);
+                if (!added || u->id != a) {
+                    std::cerr << "Log out of step with the snapshot at user " << a << "\n";
+                }
+                off += 9 + b;
+            } else if ((op == 'F' || op == 'U') && a < users->size() && b < users->size()) {
+                if (op == 'F') {
+                    users->get(a)->push_following(b);
+                    users->get(b)->followers.insert(a);
+                } else {
+                    users->get(a)->pop_following(b);
+                    users->get(b)->pop_follower(a);
+                }
+                off += 9;
+            } else {
+                break;
+            }
+            ++n;
+        }
+        return n;
+    }
+
+    UserTable* users;
+
+    int fd;                         // log thread only
+    uint32_t segment;               // the one being appended to
+    uint32_t first_segment;         // oldest still on disk
+
+    std::mutex lock;                // guards the rest
+    std::condition_variable wake;
+    std::string buf;                // records not yet written
+    uint64_t appended;              // records handed to append(...)
+    uint64_t durable;               // of those, synced
+    uint64_t snapshotted;           // of those, in the last snapshot
+    std::vector<Waiter> waiters;
+};
+
+#endif // STORE_H_
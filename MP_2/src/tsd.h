@@ -1,10 +1,24 @@
+#ifndef TSD_H_
+#define TSD_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <algorithm>
 #include <vector>
 #include <string>
+#include <unordered_map>
+#include <functional>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <atomic>
 #include <grpc++/grpc++.h>
 #include "sns.grpc.pb.h"
+#include "posts.h"
 
 // Bad practice, but we only include in tsd.cc so should be fine
-using grpc::ServerReaderWriter;
+using grpc::ServerContext;
+using grpc::ServerAsyncReaderWriter;
 using csce438::Message;
 
 // Error codes - autocomplete helps use make less mistakes :)
@@ -15,124 +29,439 @@ using csce438::Message;
 #define FAILURE_INVALID             ("FAILURE_INVALID")
 #define FAILURE_UNKNOWN             ("FAILURE_UNKNOWN")
 
-// Store username->followers in memory which enables us to track the followers for
-// a given user and conduct some operations on them
-struct User {
-    std::string username;
+// Usernames are interned to dense ids on Login, everything past the table
+// lookup works on ids
+const uint32_t NO_USER = 0xffffffff;
 
-    // users which are followers of this user, used for the LIST command
-    std::vector<std::string> followers; 
+// Compact set of user ids, open addressing with linear probing. A slot is
+// 4 bytes so a follower set costs ~6 bytes per id rather than a string
+// each, membership is O(1) instead of a scan
+struct IdSet {
+    std::vector<uint32_t> slots;    // NO_USER marks a free slot, size 0 or 2^k
+    size_t n;
 
-    // users which this user is following, used for message forwarding in TIMELINE
-    // which allows us to iterate the users table only once
-    std::vector<std::string> following; 
+    IdSet() : n(0) { }
 
-    // For timeline mode
-    bool timeline_mode;
-    ServerReaderWriter<Message, Message>* stream;
+    size_t size() const { return n; }
 
-    // Users start by following themselves
-    User(std::string n) : username(n) { 
-        // followers.push_back(n);
-        followers = std::vector<std::string>(1, n); //safer
-        following = std::vector<std::string>(1, n);
-        timeline_mode = false;
-        stream = nullptr;
-    }
-    int is_follower(std::string uname) {
-        // Return idx of user following,
-        //         -1 if none
-        for (int idx = 0; idx < followers.size(); idx++) {
-            if (followers[idx] == uname) {
-                return idx;
-            }
-        }
-        return -1;
+    size_t slot_of(uint32_t id) const {
+        return (id * 2654435761u) & (slots.size() - 1);
     }
-    bool pop_follower(std::string uname) {
-        // Return true: if the user was following and was removed,
-        //       false: if the user isn't following
-        for (int i = 0; i < followers.size(); i++) {
-            if (followers[i] == uname) {
-                followers.erase(followers.begin() + i);
+    bool contains(uint32_t id) const {
+        if (slots.empty()) {
+            return false;
+        }
+        for (size_t i = slot_of(id); slots[i] != NO_USER; i = (i + 1) & (slots.size() - 1)) {
+            if (slots[i] == id) {
                 return true;
             }
         }
         return false;
     }
-    bool push_following(std::string uname) {
-        // check if uname is in following, if not add it
-        // Return false: if the user is already in following (didn't add)
-        //        true: if use is added
-        for (int i = 0; i < following.size(); i++) {
-            if (following[i] == uname) {
-                false;
+    // Return false: if id was already in the set
+    bool insert(uint32_t id) {
+        if ((n + 1) * 4 > slots.size() * 3) {
+            grow();
+        }
+        size_t i = slot_of(id);
+        for (; slots[i] != NO_USER; i = (i + 1) & (slots.size() - 1)) {
+            if (slots[i] == id) {
+                return false;
             }
         }
-        following.push_back(uname);
+        slots[i] = id;
+        ++n;
         return true;
     }
-    bool pop_following(std::string uname) {
-        // check if uname is in following, if so remove
-        // Return false: uname wasn't there
-        //        true: if use is added
-        for (int i = 0; i < following.size(); i++) {
-            if (following[i] == uname) {
-                following.erase(following.begin() + i);
-                return true;
+    // Return false: if id wasn't in the set
+    bool erase(uint32_t id) {
+        if (slots.empty()) {
+            return false;
+        }
+        size_t mask = slots.size() - 1;
+        size_t i = slot_of(id);
+        while (slots[i] != id) {
+            if (slots[i] == NO_USER) {
+                return false;
             }
+            i = (i + 1) & mask;
         }
-        return false;
+        // Shift the rest of the probe run back so lookups never need
+        // tombstones, an entry moves only if its home slot allows it
+        for (size_t j = (i + 1) & mask; slots[j] != NO_USER; j = (j + 1) & mask) {
+            size_t home = slot_of(slots[j]);
+            if (((j - home) & mask) >= ((j - i) & mask)) {
+                slots[i] = slots[j];
+                i = j;
+            }
+        }
+        slots[i] = NO_USER;
+        --n;
+        return true;
+    }
+    // Call f(id) for each id, in no particular order. f mustn't change the set
+    template <typename F>
+    void for_each(F f) const {
+        for (size_t i = 0; i < slots.size(); i++) {
+            if (slots[i] != NO_USER) {
+                f(slots[i]);
+            }
+        }
+    }
+    // Ids in ascending order, i.e. the order users first logged in
+    std::vector<uint32_t> sorted() const {
+        std::vector<uint32_t> out;
+        out.reserve(n);
+        for (size_t i = 0; i < slots.size(); i++) {
+            if (slots[i] != NO_USER) {
+                out.push_back(slots[i]);
+            }
+        }
+        std::sort(out.begin(), out.end());
+        return out;
+    }
+
+    // Size for m ids up front, e.g. when loading a set of known size
+    void reserve(size_t m) {
+        size_t cap = slots.empty() ? 8 : slots.size();
+        while (m * 4 > cap * 3) {
+            cap *= 2;
+        }
+        if (cap != slots.size()) {
+            rehash(cap);
+        }
+    }
+
+    void grow() {
+        rehash(slots.empty() ? 8 : slots.size() * 2);
+    }
+    void rehash(size_t cap) {
+        std::vector<uint32_t> old;
+        old.swap(slots);
+        slots.assign(cap, NO_USER);
+        n = 0;
+        for (size_t i = 0; i < old.size(); i++) {
+            if (old[i] != NO_USER) {
+                insert(old[i]);
+            }
+        }
+    }
+};
+
+// pthread's reader-writer lock, std::shared_mutex is C++17. On its own
+// cache line, they're kept in arrays of stripes
+class alignas(64) RwLock {
+  public:
+    RwLock() { pthread_rwlock_init(&rw, NULL); }
+    ~RwLock() { pthread_rwlock_destroy(&rw); }
+    void lock() { pthread_rwlock_wrlock(&rw); }
+    void unlock() { pthread_rwlock_unlock(&rw); }
+    void lock_shared() { pthread_rwlock_rdlock(&rw); }
+    void unlock_shared() { pthread_rwlock_unlock(&rw); }
+
+  private:
+    RwLock(const RwLock&);
+    pthread_rwlock_t rw;
+};
+
+// What gives when a subscriber falls -q posts behind (-s)
+enum SlowPolicy {
+    DROP_OLDEST,    // discard its oldest queued post
+    DROP_NEWEST,    // discard the post being queued
+    DISCONNECT      // cancel its Timeline stream
+};
+
+size_t GLOBAL_OUTQ_LEN = 256;                   // -q
+SlowPolicy GLOBAL_SLOW_POLICY = DROP_OLDEST;    // -s
+std::atomic<uint64_t> GLOBAL_POSTS(0);          // fanned out
+std::atomic<uint64_t> GLOBAL_QUEUED(0);         // post deliveries queued
+std::atomic<uint64_t> GLOBAL_DROPPED(0);        // by the slow policy
+std::atomic<uint64_t> GLOBAL_KICKED(0);         // subscribers disconnected
+
+// One stream in TIMELINE mode. Fan-out only appends to its bounded queue
+// and, if the stream is idle, starts an async Write of the head. Each Write
+// completing (on the stream's completion queue) starts the next, so there's
+// one Write in flight at a time and no thread waits on a slow follower
+struct Subscriber {
+    ServerContext* context;
+    ServerAsyncReaderWriter<Message, Message>* stream;
+    void* write_tag;                // completion queue tag for our Writes
+
+    std::mutex lock;                // guards the rest
+    std::deque<Post> queue;         // head is being written while writing
+    bool writing;
+    bool closed;
+    size_t peak;                    // deepest the queue has been
+    uint64_t dropped;
+
+    Subscriber(ServerContext* c, ServerAsyncReaderWriter<Message, Message>* s, void* tag)
+        : context(c), stream(s), write_tag(tag), writing(false), closed(false),
+          peak(0), dropped(0) { }
+
+    // Never blocks on the stream. Return false: this subscriber is too far
+    // behind and is being disconnected
+    bool push(const Post& p) {
+        std::lock_guard<std::mutex> l(lock);
+        bool ok = queue_post(p);
+        if (!writing && !queue.empty()) {
+            write_head();
+        }
+        return ok;
+    }
+    // Queue posts together, e.g. a timeline's replay, so they're written
+    // back to back ahead of anything fanned out after them
+    bool push_all(const std::vector<Post>& posts) {
+        std::lock_guard<std::mutex> l(lock);
+        bool ok = true;
+        for (size_t i = 0; i < posts.size() && ok; i++) {
+            ok = queue_post(posts[i]);
+        }
+        if (!writing && !queue.empty()) {
+            write_head();
+        }
+        return ok;
+    }
+    // A Write completed, start the next. Return true: if none is in flight
+    bool wrote(bool ok) {
+        std::lock_guard<std::mutex> l(lock);
+        writing = false;
+        queue.pop_front();
+        // * the peer is gone, the stream's Read fails and ends the session
+        if (!ok) {
+            closed = true;
+        }
+        if (closed) {
+            queue.clear();
+        } else if (!queue.empty()) {
+            write_head();
+        }
+        return !writing;
     }
-    bool is_following(std::string uname) {
-        for (int i = 0; i < following.size(); i++) {
-            if (following[i] == uname) {
+    // Take no more posts. Return true: if no Write is in flight
+    bool close() {
+        std::lock_guard<std::mutex> l(lock);
+        closed = true;
+        if (!writing) {
+            queue.clear();
+        }
+        return !writing;
+    }
+    size_t depth() {
+        std::lock_guard<std::mutex> l(lock);
+        return queue.size();
+    }
+
+  private:
+    // lock held, Return false: as push
+    bool queue_post(const Post& p) {
+        if (closed) {
+            return true;
+        }
+        if (queue.size() >= GLOBAL_OUTQ_LEN) {
+            ++dropped;
+            ++GLOBAL_DROPPED;
+            if (GLOBAL_SLOW_POLICY == DISCONNECT) {
+                closed = true;
+                ++GLOBAL_KICKED;
+                context->TryCancel();
+                return false;
+            }
+            // * the head may be on its way out, never drop that one
+            size_t first = writing ? 1 : 0;
+            if (GLOBAL_SLOW_POLICY == DROP_NEWEST || queue.size() <= first) {
                 return true;
             }
+            queue.erase(queue.begin() + first);
         }
-        return false;
+        queue.push_back(p);
+        peak = std::max(peak, queue.size());
+        ++GLOBAL_QUEUED;
+        return true;
+    }
+    // lock held
+    void write_head() {
+        writing = true;
+        stream->Write(*queue.front(), write_tag);
+    }
+};
+
+// Store username->followers in memory which enables us to track the followers for
+// a given user and conduct some operations on them
+struct User {
+    uint32_t id;
+    std::string username;
+
+    // users which are followers of this user, used for the LIST command and
+    // as the index TIMELINE fans a post out over. This and following are
+    // guarded by the user's stripe, see UserTable
+    IdSet followers;
+
+    // users which this user is following, the mirror of followers, Follow and
+    // UnFollow keep the two in sync
+    IdSet following;
+
+    // What this user posted (own lock), see posts.h
+    PostLog posts;
+
+    // timeline_lock guards the rest. For timeline mode, owned by the user's
+    // Timeline session, and the last TIMELINE_LEN posts fanned out to it
+    // once it has entered TIMELINE (timeline_built)
+    std::mutex timeline_lock;
+    bool timeline_mode;
+    Subscriber* sub;
+    std::deque<PostRef> timeline;
+    bool timeline_built;
+
+    // Users start by following themselves
+    User(uint32_t i, std::string n) : id(i), username(n) {
+        followers.insert(id);
+        following.insert(id);
+        timeline_mode = false;
+        sub = nullptr;
+        timeline_built = false;
+    }
+    bool is_follower(uint32_t uid) const { return followers.contains(uid); }
+    bool is_following(uint32_t uid) const { return following.contains(uid); }
+    // Return true: if the user was following and was removed,
+    //       false: if the user isn't following
+    bool pop_follower(uint32_t uid) { return followers.erase(uid); }
+    // Return false: if the user is already in following (didn't add)
+    //        true: if use is added
+    bool push_following(uint32_t uid) { return following.insert(uid); }
+    // Return false: uid wasn't there
+    bool pop_following(uint32_t uid) { return following.erase(uid); }
+
+    void set_subscriber(Subscriber* s) {
+        sub = s;
+        timeline_mode = s != nullptr;
     }
+};
+
+#define NAME_STRIPES    (64)
+#define USER_STRIPES    (64)
+#define USER_CHUNK_BITS (14)
+#define USER_CHUNKS     (1 << 14)       // 2^28 users
+
+/*
+    Every user we know of. Users are never removed so an id stays valid, and
+    so does its User*. Nothing here takes one table-wide lock:
+
+      - name -> id is split over NAME_STRIPES maps by hash, each behind its
+        own reader-writer lock
+      - id -> User* is a directory of fixed chunks that are only ever
+        appended to, publishing a user is a release store of the count, so
+        get(id) and size() are lock-free
+      - a user's follow sets are guarded by stripe(id), one of USER_STRIPES
+        reader-writer locks. Fan-out reads the poster's stripe, Follow and
+        UnFollow write the two stripes involved (lock_pair)
+
+    Ids are handed out under one mutex, a new user is rare next to lookups.
+*/
+class UserTable {
+  public:
+    UserTable() : n(0) {
+        for (size_t i = 0; i < USER_CHUNKS; i++) {
+            chunks[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+    ~UserTable() {
+        for (size_t i = 0; i < size(); i++) {
+            delete get(i);
+        }
+        for (size_t i = 0; i < USER_CHUNKS; i++) {
+            delete[] chunks[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    uint32_t id_of(const std::string& uname) {
+        NameStripe& ns = names[std::hash<std::string>()(uname) % NAME_STRIPES];
+        ns.lock.lock_shared();
+        std::unordered_map<std::string, uint32_t>::const_iterator it = ns.ids.find(uname);
+        uint32_t id = it == ns.ids.end() ? NO_USER : it->second;
+        ns.lock.unlock_shared();
+        return id;
+    }
+    // Return User* entry in users table
+    //        nullptr if not found
+    User* get(const std::string& uname) {
+        uint32_t id = id_of(uname);
+        return id == NO_USER ? nullptr : get(id);
+    }
+    User* get(uint32_t id) const {
+        if (id >= n.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        return chunks[id >> USER_CHUNK_BITS].load(std::memory_order_relaxed)
+                     [id & ((1 << USER_CHUNK_BITS) - 1)];
+    }
+    const std::string& name_of(uint32_t id) const { return get(id)->username; }
+    size_t size() const { return n.load(std::memory_order_acquire); }
 
-    void set_stream(ServerReaderWriter<Message, Message>* s) {
-        stream = s;
-        timeline_mode = true;
+    // Intern uname, return its entry and whether it's new. on_add(user)
+    // runs before anyone else can see a new user, in id order
+    User* add(const std::string& uname, bool* added = nullptr,
+              std::function<void(User*)> on_add = nullptr) {
+        NameStripe& ns = names[std::hash<std::string>()(uname) % NAME_STRIPES];
+        ns.lock.lock();
+        std::unordered_map<std::string, uint32_t>::const_iterator it = ns.ids.find(uname);
+        if (added) {
+            *added = it == ns.ids.end();
+        }
+        if (it != ns.ids.end()) {
+            ns.lock.unlock();
+            return get(it->second);
+        }
+        grow.lock();
+        uint32_t id = n.load(std::memory_order_relaxed);
+        std::atomic<User**>& chunk = chunks[id >> USER_CHUNK_BITS];
+        if (chunk.load(std::memory_order_relaxed) == nullptr) {
+            chunk.store(new User*[1 << USER_CHUNK_BITS], std::memory_order_relaxed);
+        }
+        User* user = new User(id, uname);
+        if (on_add) {
+            on_add(user);
+        }
+        chunk.load(std::memory_order_relaxed)[id & ((1 << USER_CHUNK_BITS) - 1)] = user;
+        n.store(id + 1, std::memory_order_release);
+        grow.unlock();
+        ns.ids[uname] = id;
+        ns.lock.unlock();
+        return user;
     }
+
+    RwLock& stripe(uint32_t id) { return stripes[id % USER_STRIPES]; }
+    // Write-lock the stripes of two users, in stripe order so two of these
+    // never deadlock, once if they share one
+    void lock_pair(uint32_t a, uint32_t b) {
+        size_t x = std::min(a % USER_STRIPES, b % USER_STRIPES);
+        size_t y = std::max(a % USER_STRIPES, b % USER_STRIPES);
+        stripes[x].lock();
+        if (y != x) {
+            stripes[y].lock();
+        }
+    }
+    void unlock_pair(uint32_t a, uint32_t b) {
+        stripes[a % USER_STRIPES].unlock();
+        if (a % USER_STRIPES != b % USER_STRIPES) {
+            stripes[b % USER_STRIPES].unlock();
+        }
+    }
+    // Hold off new users, e.g. to line a snapshot up with the log. Follows
+    // and posts carry on
+    void lock_ids() { grow.lock(); }
+    void unlock_ids() { grow.unlock(); }
+
+  private:
+    struct NameStripe {
+        RwLock lock;
+        std::unordered_map<std::string, uint32_t> ids;
+    };
+
+    NameStripe names[NAME_STRIPES];
+    std::mutex grow;                                // hands out ids
+    std::atomic<User**> chunks[USER_CHUNKS];
+    std::atomic<uint32_t> n;
+    RwLock stripes[USER_STRIPES];
 };
 
-// ------- Unused -------
-// struct UserStream {
-//     std::string username;
-//     grpc::ServerReaderWriter<Message, Message>* stream;
-//     UserStream(std::string n, grpc::ServerReaderWriter<Message, Message>* s) {
-//         username = n;
-//         stream = s;
-//     }
-// };
-// ------- Unimplemented | Untested -------
-// struct UserTable {
-//     // We're pointing, because if a user is removed we can no longer
-//     // refer to their index in users as a pointer
-//     std::vector<User*> users;
-
-//     UserTable() : users(std::vector<User*>()) { }
-//     ~UserTable() {
-//         for (int i = 0; i < users.size(); i++) {
-//             delete users[i];
-//         }
-//     }
-//     User* get_user_entry(std::string uname) { // if pointing, return nullptr
-//         // Return User* entry in users table
-//         //        nullptr if not found
-//         for (int idx = 0; idx < users.size(); idx++) {
-//             if (users[idx]->username == uname) {
-//                 return users[idx];
-//             }
-//         }
-//         return nullptr;
-//     }
-//     void add_user(std::string uname) { users.push_back(new User(uname)); }
-
-//     // TODO
-//     bool read_users(std::string file);
-//     bool write_users(std::string file);
-// };
\ No newline at end of file
+#endif // TSD_H_
@@ -0,0 +1,538 @@
+/*
+    tsd_bench, end-to-end load generator for tsd
+
+    Starts tsd as a child on a fresh store (or uses a running one with -a),
+    logs in N synthetic users and builds a power-law follow graph through
+    the Follow RPC: every user follows F others, picked with probability
+    ~ 1/rank^ZIPF_S, so a few users collect most of the followers. Then M
+    random users open Timeline streams and post round robin at a fixed
+    total rate. Every post carries its send time, so each delivery gives
+    one end-to-end latency sample (poster's Write -> follower's Read, both
+    on this host).
+
+    Reports the graph build rate, posts and fan-out deliveries per second
+    (against the deliveries the graph says to expect), delivery latency
+    percentiles and the server's CPU use over the run.
+
+        make tsd tsd_bench
+        ./tsd_bench -n 10000 -f 20 -m 500 -r 200 -d 10
+*/
+#include <sys/wait.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <grpc++/grpc++.h>
+#include "sns.grpc.pb.h"
+
+using csce438::Message;
+using csce438::Reply;
+using csce438::Request;
+using csce438::SNSService;
+using grpc::ClientAsyncReaderWriter;
+using grpc::ClientContext;
+using grpc::CompletionQueue;
+using std::string;
+using std::vector;
+using std::cout;
+using std::cerr;
+
+/* Macros */
+#define HIST_SUB        (16)            // linear buckets per power of two
+#define HIST_LEN        (64 * HIST_SUB)
+#define ZIPF_S          (1.0)           // follow popularity ~ 1/rank^s
+#define SETUP_THREADS   (32)            // concurrent Login/Follow calls
+#define CHANNELS        (16)            // streams are spread over these
+
+// Completion queue tags, {stream index||op}
+#define OP_STARTED      (0)
+#define OP_WROTE        (1)
+#define OP_READ         (2)
+#define OP_BITS         (2)
+
+/* Types */
+struct bench_stream {
+    int user;
+    uint64_t fanout;                // followers with a stream, self included
+    ClientContext context;
+    std::unique_ptr<ClientAsyncReaderWriter<Message, Message>> stream;
+    Message in;                     // completion queue thread only
+
+    std::mutex lock;                // guards the rest
+    Message writing;                // in flight while busy
+    std::deque<Message> out;
+    bool busy;
+};
+
+/* Globals */
+int GLOBAL_N_USERS = 1000;
+int GLOBAL_FOLLOWS = 10;                // per user
+int GLOBAL_N_STREAMS = 100;
+double GLOBAL_RATE = 100;               // posts/sec over all streams
+int GLOBAL_MSG_SIZE = 64;               // post text, at least the send time
+int GLOBAL_DURATION = 5;                // seconds of posting
+string GLOBAL_TSD = "./tsd";
+string GLOBAL_ADDR;                     // -a, empty to start our own tsd
+int GLOBAL_PORT = 3055;
+int GLOBAL_SERVER_PID = 0;
+
+vector<std::shared_ptr<grpc::Channel>> GLOBAL_CHANNELS;
+vector<bench_stream*> GLOBAL_STREAMS;
+std::atomic<int> GLOBAL_STARTED(0);
+std::atomic<uint64_t> GLOBAL_SENT(0);
+std::atomic<uint64_t> GLOBAL_EXPECTED(0);
+std::atomic<uint64_t> GLOBAL_RECVD(0);
+std::atomic<uint64_t> GLOBAL_REPLAYED(0);   // history from an earlier run, not counted
+uint64_t GLOBAL_OPENED;                 // when the streams were opened
+std::atomic<uint64_t> GLOBAL_FAILED(0); // setup calls that didn't succeed
+uint64_t GLOBAL_HIST[HIST_LEN];         // latency ns, completion queue thread only
+
+void usage() {
+    cout << "usage: ./tsd_bench [-n users] [-f follows per user] [-m streams] [-r posts/sec] "
+         << "[-s msg_size] [-d seconds] [-x tsd_path] [-P port] [-a host:port -p server_pid]\n";
+    exit(1);
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Log-linear buckets: HIST_SUB per power of two, ~6% resolution
+int hist_bucket(uint64_t v) {
+    if (v < HIST_SUB)
+        return (int) v;
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - 4;
+    return (shift + 1) * HIST_SUB + (int) ((v >> shift) - HIST_SUB);
+}
+
+uint64_t hist_value(int b) {
+    if (b < HIST_SUB)
+        return b;
+    int shift = b / HIST_SUB - 1;
+    return ((uint64_t) (b % HIST_SUB + HIST_SUB) << shift) + ((1ull << shift) >> 1);
+}
+
+uint64_t hist_percentile(double p) {
+    uint64_t total = 0, seen = 0;
+    for (int i = 0; i < HIST_LEN; i++)
+        total += GLOBAL_HIST[i];
+    if (total == 0)
+        return 0;
+    uint64_t want = (uint64_t) (p * total);
+    for (int i = 0; i < HIST_LEN; i++) {
+        seen += GLOBAL_HIST[i];
+        if (seen > want)
+            return hist_value(i);
+    }
+    return hist_value(HIST_LEN - 1);
+}
+
+// utime + stime of pid in seconds, -1 if we can't read it
+double proc_cpu(int pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+
+    char buf[1024];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+
+    // comm may hold spaces, fields after it are space separated from 3 on
+    char* p = strrchr(buf, ')');
+    unsigned long utime, stime;
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                            &utime, &stime) != 2)
+        return -1;
+    return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+string user_name(int i) {
+    return "bench" + std::to_string(i);
+}
+
+// tsd on a fresh store in dir, stderr passed through
+pid_t spawn_tsd(const string& dir) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Failure on fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        string port = std::to_string(GLOBAL_PORT);
+        execl(GLOBAL_TSD.c_str(), GLOBAL_TSD.c_str(), "-p", port.c_str(), "-d", dir.c_str(),
+              "-S", "0", (char*) NULL);
+        perror("Failure on exec of tsd");
+        _exit(1);
+    }
+    return pid;
+}
+
+// Distinct channels, so streams don't all share one HTTP/2 connection
+void connect_channels() {
+    for (int i = 0; i < CHANNELS; i++) {
+        grpc::ChannelArguments args;
+        args.SetInt("tsd_bench.channel", i);
+        GLOBAL_CHANNELS.push_back(grpc::CreateCustomChannel(
+            GLOBAL_ADDR, grpc::InsecureChannelCredentials(), args));
+    }
+    std::chrono::system_clock::time_point deadline =
+        std::chrono::system_clock::now() + std::chrono::seconds(5);
+    for (int i = 0; i < CHANNELS; i++) {
+        if (!GLOBAL_CHANNELS[i]->WaitForConnected(deadline)) {
+            cerr << "Failure connecting to " << GLOBAL_ADDR << "\n";
+            exit(1);
+        }
+    }
+}
+
+bool login(SNSService::Stub* stub, const string& user) {
+    ClientContext context;
+    Request request;
+    Reply reply;
+    request.set_username(user);
+    return stub->Login(&context, request, &reply).ok();
+}
+
+bool follow(SNSService::Stub* stub, const string& user, const string& followed) {
+    ClientContext context;
+    Request request;
+    Reply reply;
+    request.set_username(user);
+    request.add_arguments(followed);
+    return stub->Follow(&context, request, &reply).ok() && reply.msg() == "SUCCESS";
+}
+
+// Run f(stub, i) for i in [0, n) over SETUP_THREADS threads
+template <typename F>
+void setup_calls(int n, F f) {
+    vector<std::thread> threads;
+    for (int t = 0; t < SETUP_THREADS; t++) {
+        threads.push_back(std::thread([t, n, &f] {
+            std::unique_ptr<SNSService::Stub> stub =
+                SNSService::NewStub(GLOBAL_CHANNELS[t % CHANNELS]);
+            for (int i = t; i < n; i += SETUP_THREADS) {
+                f(stub.get(), i);
+            }
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++) {
+        threads[t].join();
+    }
+}
+
+/*
+ * Log everyone in and have user i follow follows[i]. Followees are drawn
+ * from a Zipf distribution over a shuffled ranking
+ *
+ * @return the followers of each user, self included as tsd does
+ */
+vector<vector<int>> build_graph(std::mt19937& rng) {
+    int n = GLOBAL_N_USERS;
+    vector<int> rank(n);
+    for (int i = 0; i < n; i++) {
+        rank[i] = i;
+    }
+    std::shuffle(rank.begin(), rank.end(), rng);
+    vector<double> cdf(n);
+    double sum = 0;
+    for (int i = 0; i < n; i++) {
+        sum += 1.0 / pow(i + 1, ZIPF_S);
+        cdf[i] = sum;
+    }
+
+    vector<vector<int>> follows(n);
+    vector<vector<int>> followers(n);
+    std::uniform_real_distribution<double> u(0, sum);
+    int want = std::min(GLOBAL_FOLLOWS, n - 1);
+    for (int i = 0; i < n; i++) {
+        followers[i].push_back(i);
+        // * the head of the distribution runs out fast, give up on a user
+        //   once draws stop finding anyone new
+        for (int tries = 0; (int) follows[i].size() < want && tries < want * 20; tries++) {
+            int f = rank[std::lower_bound(cdf.begin(), cdf.end(), u(rng)) - cdf.begin()];
+            if (f != i && std::find(follows[i].begin(), follows[i].end(), f) == follows[i].end()) {
+                follows[i].push_back(f);
+                followers[f].push_back(i);
+            }
+        }
+    }
+
+    setup_calls(n, [](SNSService::Stub* stub, int i) {
+        if (!login(stub, user_name(i))) {
+            ++GLOBAL_FAILED;
+        }
+    });
+    setup_calls(n, [&follows](SNSService::Stub* stub, int i) {
+        for (size_t j = 0; j < follows[i].size(); j++) {
+            if (!follow(stub, user_name(i), user_name(follows[i][j]))) {
+                ++GLOBAL_FAILED;
+            }
+        }
+    });
+    return followers;
+}
+
+// lock held
+void write_next(bench_stream* s, int i) {
+    s->writing = s->out.front();
+    s->out.pop_front();
+    s->busy = true;
+    s->stream->Write(s->writing, (void*) (intptr_t) (i << OP_BITS | OP_WROTE));
+}
+
+void queue_write(bench_stream* s, int i, const Message& m) {
+    std::lock_guard<std::mutex> l(s->lock);
+    s->out.push_back(m);
+    if (!s->busy) {
+        write_next(s, i);
+    }
+}
+
+// Every stream's completions: INIT on start, chain writes, one latency
+// sample per post read
+void drain(CompletionQueue* cq) {
+    void* tag;
+    bool ok;
+    while (cq->Next(&tag, &ok)) {
+        int i = (int) ((intptr_t) tag >> OP_BITS);
+        int op = (int) ((intptr_t) tag & ((1 << OP_BITS) - 1));
+        bench_stream* s = GLOBAL_STREAMS[i];
+        if (!ok) {
+            continue;
+        }
+        if (op == OP_STARTED) {
+            Message init;
+            init.set_username(user_name(s->user));
+            init.set_msg("INIT");
+            queue_write(s, i, init);
+            s->stream->Read(&s->in, (void*) (intptr_t) (i << OP_BITS | OP_READ));
+            ++GLOBAL_STARTED;
+        } else if (op == OP_WROTE) {
+            std::lock_guard<std::mutex> l(s->lock);
+            s->busy = false;
+            if (!s->out.empty()) {
+                write_next(s, i);
+            }
+        } else {
+            // * msg = "<SEND TIME> padding"
+            uint64_t now = now_ns();
+            uint64_t t = strtoull(s->in.msg().c_str(), NULL, 10);
+            if (t < GLOBAL_OPENED) {
+                ++GLOBAL_REPLAYED;
+            } else {
+                ++GLOBAL_HIST[hist_bucket(now > t ? now - t : 0)];
+                ++GLOBAL_RECVD;
+            }
+            s->stream->Read(&s->in, (void*) (intptr_t) (i << OP_BITS | OP_READ));
+        }
+    }
+}
+
+// Open a stream for each of m random users
+void open_streams(CompletionQueue* cq, const vector<vector<int>>& followers, std::mt19937& rng) {
+    vector<int> users(GLOBAL_N_USERS);
+    vector<bool> streaming(GLOBAL_N_USERS, false);
+    for (int i = 0; i < GLOBAL_N_USERS; i++) {
+        users[i] = i;
+    }
+    std::shuffle(users.begin(), users.end(), rng);
+    for (int i = 0; i < GLOBAL_N_STREAMS; i++) {
+        streaming[users[i]] = true;
+    }
+    for (int i = 0; i < GLOBAL_N_STREAMS; i++) {
+        bench_stream* s = new bench_stream();
+        s->user = users[i];
+        s->busy = false;
+        s->fanout = 0;
+        for (size_t j = 0; j < followers[s->user].size(); j++) {
+            s->fanout += streaming[followers[s->user][j]];
+        }
+        GLOBAL_STREAMS.push_back(s);
+    }
+    for (int i = 0; i < GLOBAL_N_STREAMS; i++) {
+        bench_stream* s = GLOBAL_STREAMS[i];
+        std::unique_ptr<SNSService::Stub> stub = SNSService::NewStub(GLOBAL_CHANNELS[i % CHANNELS]);
+        s->stream = stub->AsyncTimeline(&s->context, cq, (void*) (intptr_t) (i << OP_BITS | OP_STARTED));
+    }
+}
+
+// Paces every stream's posts off one clock
+void poster() {
+    string pad(GLOBAL_MSG_SIZE, 'x');
+    double interval = 1e9 / GLOBAL_RATE;
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t) GLOBAL_DURATION * 1000000000ull;
+    uint64_t k = 0;
+
+    while (true) {
+        uint64_t due = start + (uint64_t) (k * interval);
+        uint64_t now = now_ns();
+        if (due >= end)
+            break;
+        if (due > now) {
+            struct timespec ts = { 0, (long) (due - now) };
+            nanosleep(&ts, NULL);
+        }
+
+        // * stamped as late as possible
+        int i = k % GLOBAL_N_STREAMS;
+        bench_stream* s = GLOBAL_STREAMS[i];
+        Message m;
+        m.set_username(user_name(s->user));
+        string text = std::to_string(now_ns()) + " ";
+        if ((int) text.size() < GLOBAL_MSG_SIZE) {
+            text.append(pad, 0, GLOBAL_MSG_SIZE - text.size());
+        }
+        m.set_msg(text);
+        queue_write(s, i, m);
+        ++GLOBAL_SENT;
+        GLOBAL_EXPECTED += s->fanout;
+        ++k;
+    }
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:f:m:r:s:d:x:P:a:p:")) != -1) {
+        switch (opt) {
+            case 'n':
+                GLOBAL_N_USERS = atoi(optarg);
+                break;
+            case 'f':
+                GLOBAL_FOLLOWS = atoi(optarg);
+                break;
+            case 'm':
+                GLOBAL_N_STREAMS = atoi(optarg);
+                break;
+            case 'r':
+                GLOBAL_RATE = atof(optarg);
+                break;
+            case 's':
+                GLOBAL_MSG_SIZE = atoi(optarg);
+                break;
+            case 'd':
+                GLOBAL_DURATION = atoi(optarg);
+                break;
+            case 'x':
+                GLOBAL_TSD = optarg;
+                break;
+            case 'P':
+                GLOBAL_PORT = atoi(optarg);
+                break;
+            case 'a':
+                GLOBAL_ADDR = optarg;
+                break;
+            case 'p':
+                GLOBAL_SERVER_PID = atoi(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind != argc || GLOBAL_N_USERS < 1 || GLOBAL_FOLLOWS < 0 || GLOBAL_N_STREAMS < 1
+            || GLOBAL_N_STREAMS > GLOBAL_N_USERS || GLOBAL_RATE <= 0 || GLOBAL_DURATION < 1) {
+        usage();
+    }
+
+    // * our own tsd unless pointed at one, on a store that's thrown away
+    char dir[] = "/tmp/tsd_bench.XXXXXX";
+    pid_t child = 0;
+    if (GLOBAL_ADDR.empty()) {
+        if (mkdtemp(dir) == NULL) {
+            perror("Failure on mkdtemp");
+            exit(1);
+        }
+        child = spawn_tsd(dir);
+        GLOBAL_SERVER_PID = child;
+        GLOBAL_ADDR = "127.0.0.1:" + std::to_string(GLOBAL_PORT);
+    }
+    connect_channels();
+
+    // * graph, then streams, then let the INITs settle
+    std::mt19937 rng(438);
+    uint64_t start = now_ns();
+    vector<vector<int>> followers = build_graph(rng);
+    double setup_secs = (now_ns() - start) / 1e9;
+    uint64_t n_follows = 0;
+    for (size_t i = 0; i < followers.size(); i++) {
+        n_follows += followers[i].size() - 1;
+    }
+
+    CompletionQueue cq;
+    GLOBAL_OPENED = now_ns();
+    open_streams(&cq, followers, rng);
+    std::thread drainer(drain, &cq);
+    while (GLOBAL_STARTED < GLOBAL_N_STREAMS) {
+        usleep(10000);
+    }
+    usleep(200000);
+
+    // * run, then give in-flight fan-out a moment to arrive
+    double cpu_start = GLOBAL_SERVER_PID ? proc_cpu(GLOBAL_SERVER_PID) : -1;
+    start = now_ns();
+    poster();
+    double send_secs = (now_ns() - start) / 1e9;
+    usleep(500000);
+    double wall_secs = (now_ns() - start) / 1e9;
+    double cpu_end = GLOBAL_SERVER_PID ? proc_cpu(GLOBAL_SERVER_PID) : -1;
+
+    for (int i = 0; i < GLOBAL_N_STREAMS; i++) {
+        GLOBAL_STREAMS[i]->context.TryCancel();
+    }
+    cq.Shutdown();
+    drainer.join();
+
+    // * report
+    printf("users %d, follows %d each, streams %d, rate %.1f posts/s, size %d B, %d s\n",
+           GLOBAL_N_USERS, GLOBAL_FOLLOWS, GLOBAL_N_STREAMS, GLOBAL_RATE, GLOBAL_MSG_SIZE,
+           GLOBAL_DURATION);
+    printf("graph     %lu follows in %.2f s, %.0f calls/sec, %lu failed\n",
+           (unsigned long) n_follows, setup_secs, (GLOBAL_N_USERS + n_follows) / setup_secs,
+           (unsigned long) GLOBAL_FAILED.load());
+    printf("posted    %lu posts, %.0f posts/sec\n",
+           (unsigned long) GLOBAL_SENT.load(), GLOBAL_SENT / send_secs);
+    printf("delivered %lu of %lu expected, %.0f deliveries/sec\n",
+           (unsigned long) GLOBAL_RECVD.load(), (unsigned long) GLOBAL_EXPECTED.load(),
+           GLOBAL_RECVD / send_secs);
+    if (GLOBAL_REPLAYED > 0) {
+        printf("replayed  %lu posts from an earlier run, not counted\n",
+               (unsigned long) GLOBAL_REPLAYED.load());
+    }
+    printf("latency   p50 %.1f us, p99 %.1f us, p999 %.1f us\n",
+           hist_percentile(0.50) / 1e3, hist_percentile(0.99) / 1e3,
+           hist_percentile(0.999) / 1e3);
+    if (cpu_start >= 0 && cpu_end >= 0) {
+        printf("server    %.2f s cpu, %.1f%% of one core\n",
+               cpu_end - cpu_start, 100 * (cpu_end - cpu_start) / wall_secs);
+    }
+    fflush(stdout);
+
+    if (child) {
+        kill(child, SIGTERM);
+        waitpid(child, NULL, 0);
+        string rm = string("rm -rf ") + dir;
+        if (system(rm.c_str()) != 0) {
+            cerr << "Couldn't remove " << dir << "\n";
+        }
+    }
+    _exit(0);
+}